@@ -0,0 +1,125 @@
+#pragma once
+
+// Анимация по ключевым кадрам: положения сфер и источников света линейно
+// интерполируются между ключами. Файл анимации - по одной команде в строке,
+// # начинает комментарий:
+//   frames count
+//   key frame sphere index x y z   (индекс - порядковый номер сферы в сцене)
+//   key frame light index x y z
+// До первого и после последнего ключа положение не меняется.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedfile.h"
+#include "raytracer.h"
+
+struct Animation {
+    struct Key {
+        int frame;
+        Vec3 pos;
+    };
+
+    enum Target { kSphere, kLight };
+
+    int frames = 1;
+    // Ключи каждой дорожки (цель, индекс), упорядоченные по кадрам
+    std::map<std::pair<int, int>, std::vector<Key>> tracks;
+
+    // Положение на дорожке в кадре frame
+    static Vec3 sample(const std::vector<Key>& keys, int frame) {
+        if (frame <= keys.front().frame) return keys.front().pos;
+        if (frame >= keys.back().frame) return keys.back().pos;
+        auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](int f, const Key& k) { return f < k.frame; });
+        auto prev = next - 1;
+        float a = float(frame - prev->frame) / float(next->frame - prev->frame);
+        return prev->pos * (1.0f - a) + next->pos * a;
+    }
+
+    // Переносит положения кадра frame в сцену и источники. Сферы и источники
+    // сдвигаются на месте, после чего их BVH подгоняются без перестроения.
+    void apply(int frame, Scene& scene, LightSet& lights) const {
+        bool moved = false, lightsMoved = false;
+        for (const auto& track : tracks) {
+            Vec3 p = sample(track.second, frame);
+            int index = track.first.second;
+            if (track.first.first == kLight) {
+                if (index < lights.count()) lights.move(index, p);
+                lightsMoved = true;
+                continue;
+            }
+            int slot = scene.sphereSlot(index);
+            scene.sphereX[slot] = p.x;
+            scene.sphereY[slot] = p.y;
+            scene.sphereZ[slot] = p.z;
+            moved = true;
+        }
+        if (moved) scene.refit();
+        if (lightsMoved) lights.refit();
+    }
+};
+
+inline bool loadAnimation(const std::string& path, const Scene& scene, int lightCount, Animation& anim, std::string& error) {
+    MappedFile file(path);
+    if (!file.ok()) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const char* p = file.data();
+    const char* end = p + file.size();
+    char line[512];
+    int lineNumber = 0;
+
+    while (p < end) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        lineNumber++;
+        size_t length = std::min((size_t)(eol - p), sizeof(line) - 1);
+        std::memcpy(line, p, length);
+        line[length] = 0;
+        p = eol + 1;
+
+        if (char* comment = std::strchr(line, '#')) *comment = 0;
+
+        auto fail = [&](const std::string& message) {
+            error = path + ":" + std::to_string(lineNumber) + ": " + message;
+            return false;
+        };
+
+        char command[16], target[16];
+        int frame, index;
+        float x, y, z;
+        if (std::sscanf(line, "%15s", command) != 1) continue;
+        if (std::strcmp(command, "frames") == 0) {
+            if (std::sscanf(line, "%*s %d", &anim.frames) != 1 || anim.frames < 1) return fail("bad frame count");
+        } else if (std::strcmp(command, "key") == 0) {
+            if (std::sscanf(line, "%*s %d %15s %d %f %f %f", &frame, target, &index, &x, &y, &z) != 6) {
+                return fail("expected: key frame sphere|light index x y z");
+            }
+            int kind;
+            if (std::strcmp(target, "sphere") == 0) {
+                if (index < 0 || index >= scene.sphereCount()) return fail("no sphere " + std::to_string(index));
+                kind = Animation::kSphere;
+            } else if (std::strcmp(target, "light") == 0) {
+                if (index < 0 || index >= lightCount) return fail("no light " + std::to_string(index));
+                kind = Animation::kLight;
+            } else {
+                return fail(std::string("unknown target '") + target + "'");
+            }
+            auto& keys = anim.tracks[{kind, index}];
+            Animation::Key key = {frame, Vec3(x, y, z)};
+            auto at = std::upper_bound(keys.begin(), keys.end(), frame, [](int f, const Animation::Key& k) { return f < k.frame; });
+            if (at != keys.begin() && (at - 1)->frame == frame) return fail("duplicate key for frame " + std::to_string(frame));
+            keys.insert(at, key);
+        } else {
+            return fail(std::string("unknown command '") + command + "'");
+        }
+    }
+    return true;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+// Линейный распределитель памяти для временных данных тайла: очередей лучей,
+// попаданий, порядка пикселей. Память выдаётся сдвигом указателя внутри
+// блока и освобождается вся сразу вызовом reset() перед следующим тайлом.
+// Блоки системе не возвращаются. Если тайлу не хватило одного блока, reset()
+// заменяет их одним блоком общего размера, так что после первых тайлов
+// арена перестаёт обращаться к куче. peak() - наибольший расход за один
+// тайл; reserve() по нему позволяет заранее подготовить арены всех потоков.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class Arena {
+public:
+    explicit Arena(std::size_t blockSize_ = 64 * 1024) : blockSize(blockSize_) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    void* allocate(std::size_t bytes, std::size_t align) {
+        for (;;) {
+            if (current < blocks.size()) {
+                Block& b = blocks[current];
+                std::uintptr_t base = (std::uintptr_t)b.data.get();
+                std::uintptr_t p = (base + offset + align - 1) & ~(std::uintptr_t)(align - 1);
+                if (p + bytes <= base + b.size) {
+                    offset = p + bytes - base;
+                    return (void*)p;
+                }
+                current++;
+                offset = 0;
+                continue;
+            }
+            std::size_t size = std::max(blockSize, bytes + align);
+            blocks.push_back({std::unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+        }
+    }
+
+    template <class T>
+    T* allocate(std::size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "reset() не вызывает деструкторы");
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // Освобождает всё выделенное с прошлого reset()
+    void reset() {
+        highWater = peak();
+        if (blocks.size() > 1) reserve(capacity());
+        current = 0;
+        offset = 0;
+    }
+
+    // Делает арену одним блоком не меньше bytes. Как и reset(), освобождает
+    // всё выделенное.
+    void reserve(std::size_t bytes) {
+        highWater = peak();
+        if (bytes > 0 && (blocks.size() != 1 || blocks[0].size < bytes)) {
+            bytes = std::max(bytes, capacity());
+            blocks.clear();
+            blocks.push_back({std::unique_ptr<unsigned char[]>(new unsigned char[bytes]), bytes});
+        }
+        current = 0;
+        offset = 0;
+    }
+
+    std::size_t capacity() const {
+        std::size_t total = 0;
+        for (const Block& b : blocks) total += b.size;
+        return total;
+    }
+
+    // Наибольший расход между двумя reset(), включая текущий
+    std::size_t peak() const {
+        std::size_t used = offset;
+        for (std::size_t i = 0; i < current && i < blocks.size(); i++) used += blocks[i].size;
+        return std::max(highWater, used);
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+    };
+
+    std::size_t blockSize;
+    std::vector<Block> blocks;
+    std::size_t current = 0; // блок, из которого идёт выделение
+    std::size_t offset = 0;  // занятая часть текущего блока
+    std::size_t highWater = 0;
+};
+
+// Растущий массив в арене для тривиально копируемых T. При переполнении
+// содержимое переносится в участок вдвое больше, старый остаётся занятым до
+// reset(). После reset() арены массив нужно заново привязать через bind().
+template <class T>
+class ArenaArray {
+    static_assert(std::is_trivially_copyable<T>::value, "элементы переносятся memcpy");
+
+public:
+    void bind(Arena& a) {
+        arena = &a;
+        items = nullptr;
+        count = 0;
+        capacity = 0;
+    }
+
+    void clear() { count = 0; }
+
+    void push_back(const T& v) {
+        if (count == capacity) reserve(capacity ? capacity * 2 : 256);
+        items[count++] = v;
+    }
+
+    void assign(std::size_t n, const T& v) {
+        clear();
+        reserve(n);
+        for (std::size_t i = 0; i < n; i++) items[i] = v;
+        count = n;
+    }
+
+    void reserve(std::size_t n) {
+        if (n <= capacity) return;
+        T* grown = arena->allocate<T>(n);
+        if (count) std::memcpy(grown, items, count * sizeof(T));
+        items = grown;
+        capacity = n;
+    }
+
+    void swap(ArenaArray& o) {
+        std::swap(arena, o.arena);
+        std::swap(items, o.items);
+        std::swap(count, o.count);
+        std::swap(capacity, o.capacity);
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](std::size_t i) { return items[i]; }
+    const T& operator[](std::size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + count; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+
+private:
+    Arena* arena = nullptr;
+    T* items = nullptr;
+    std::size_t count = 0;
+    std::size_t capacity = 0;
+};
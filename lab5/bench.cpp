@@ -0,0 +1,305 @@
+// Микробенчмарки ядер трассировщика на фиксированных наборах лучей.
+//
+// RayTracerBench [--rays N] [--min-time ms] [--spheres N] [--glossy F] [--lights N]
+//                [--light-samples N] [--filter kernel] [--json path]
+//
+// Каждое ядро прогоняется по каждому набору лучей, пока не наберётся --min-time
+// миллисекунд. Результат - наносекунды на вызов и лучи в секунду; с --json
+// результаты дополнительно пишутся в JSON (путь "-" - в stdout вместо таблицы),
+// чтобы их можно было сравнивать между коммитами. --lights добавляет к двум
+// источникам сцены слабые источники с затуханием: при выборе --light-samples
+// источников в точке время trace почти не зависит от их числа.
+//
+// Наборы bounce и bounce-sorted - одни и те же отражённые лучи от попаданий
+// первичных лучей кадра: в порядке строк, как их порождает трассировщик, и
+// упорядоченные по coherenceKey. Разница scene_intersect на них - выигрыш от
+// сортировки вторичных лучей; на сценах с множеством зеркальных сфер
+// (--spheres 20000 --glossy 1) она заметнее всего.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "options.h"
+#include "raytracer.h"
+
+namespace {
+
+struct Ray {
+    Vec3 orig, dir;
+    Vec3 normal; // нормаль для refract, fresnel и inShadow
+};
+
+struct RaySet {
+    std::string name;
+    std::vector<Ray> rays;
+};
+
+struct Result {
+    std::string kernel;
+    std::string raySet;
+    double nsPerOp;
+    double raysPerSecond;
+};
+
+// Результаты ядер складываются сюда, чтобы компилятор не выбросил вычисления
+volatile float sink = 0.0f;
+
+const Vec3 kLightPos1(-2, 5, -3);
+
+Vec3 randomUnit(std::mt19937& rng) {
+    std::normal_distribution<float> n(0.0f, 1.0f);
+    for (;;) {
+        Vec3 v(n(rng), n(rng), n(rng));
+        if (v.length() > 1e-6f) return v.normalize();
+    }
+}
+
+// Первичные лучи камеры из демонстрационной сцены по сетке вокруг сфер
+RaySet coherentRays(int count) {
+    RaySet set{"coherent", {}};
+    int side = std::max(1, (int)std::sqrt((float)count));
+    float angle = std::tan(30.0f * (float)M_PI / 180.0f);
+    for (int i = 0; i < count; i++) {
+        int x = i % side, y = (i / side) % side;
+        float xx = (2 * ((x + 0.5f) / side) - 1) * angle * 0.6f;
+        float yy = (1 - 2 * ((y + 0.5f) / side)) * angle * 0.4f;
+        set.rays.push_back({Vec3(0, 0, 0), Vec3(xx, yy, -1).normalize(), Vec3(0, 0, 1)});
+    }
+    return set;
+}
+
+// Случайные начала внутри сцены и равномерно распределённые направления
+RaySet incoherentRays(int count, std::mt19937& rng) {
+    RaySet set{"incoherent", {}};
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    for (int i = 0; i < count; i++) {
+        Vec3 orig(-3.0f + 6.0f * u(rng), -1.4f + 4.4f * u(rng), -7.0f + 6.0f * u(rng));
+        set.rays.push_back({orig, randomUnit(rng), randomUnit(rng)});
+    }
+    return set;
+}
+
+// Лучи, проходящие почти по касательной к сферам сцены
+RaySet grazingRays(int count, std::mt19937& rng, const std::vector<Sphere>& spheres) {
+    RaySet set{"grazing", {}};
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    for (int i = 0; i < count; i++) {
+        const Sphere& s = spheres[i % spheres.size()];
+        Vec3 dir = randomUnit(rng);
+        Vec3 side = dir.cross(randomUnit(rng)).normalize();
+        Vec3 touch = s.center + side * (s.radius * (1.0f + 1e-3f * u(rng)));
+        set.rays.push_back({touch - dir * 10.0f, dir, side});
+    }
+    return set;
+}
+
+// Лучи из камеры круто вверх: не пересекают ни сферы, ни плоскость пола
+RaySet missRays(int count, std::mt19937& rng) {
+    RaySet set{"all-miss", {}};
+    std::uniform_real_distribution<float> u(-0.4f, 0.4f);
+    for (int i = 0; i < count; i++) {
+        set.rays.push_back({Vec3(0, 0, 0), Vec3(u(rng), 1.0f, u(rng) - 0.2f).normalize(), Vec3(0, 1, 0)});
+    }
+    return set;
+}
+
+// Отражения от попаданий первичных лучей по сетке всего кадра (поле зрения
+// 60 градусов, 4:3) в порядке строк. Сетка в четыре раза гуще count, так
+// что лучи неба и промахи набор не обедняют.
+RaySet bounceRays(int count, const Scene& scene) {
+    RaySet set{"bounce", {}};
+    int side = std::max(1, (int)std::sqrt((float)count)) * 2;
+    float angle = std::tan(30.0f * (float)M_PI / 180.0f);
+    for (int y = 0; y < side && (int)set.rays.size() < count; y++) {
+        for (int x = 0; x < side && (int)set.rays.size() < count; x++) {
+            float xx = (2 * ((x + 0.5f) / side) - 1) * angle * (4.0f / 3.0f);
+            float yy = (1 - 2 * ((y + 0.5f) / side)) * angle;
+            Vec3 dir = Vec3(xx, yy, -1).normalize();
+            Hit hit;
+            if (!scene.intersect(Vec3(0, 0, 0), dir, hit)) continue;
+            Vec3 phit = dir * hit.t;
+            Vec3 n = scene.normal(hit, phit);
+            Vec3 refl = (dir - n * 2 * dir.dot(n)).normalize();
+            set.rays.push_back({phit + n * 1e-4f, refl, n});
+        }
+    }
+    return set;
+}
+
+// Те же лучи, упорядоченные так, как их упорядочивает волновой трассировщик
+RaySet sortedRays(const RaySet& source, const Scene& scene) {
+    RaySet set{source.name + "-sorted", source.rays};
+    AABB bounds = scene.bounds();
+    std::stable_sort(set.rays.begin(), set.rays.end(), [&](const Ray& a, const Ray& b) {
+        return coherenceKey(a.orig, a.dir, bounds) < coherenceKey(b.orig, b.dir, bounds);
+    });
+    return set;
+}
+
+template <class Fn>
+Result measure(const std::string& kernel, const RaySet& set, double minMs, Fn&& fn) {
+    using Clock = std::chrono::steady_clock;
+    for (const Ray& r : set.rays) fn(r); // прогрев
+
+    long long ops = 0;
+    auto start = Clock::now();
+    double elapsedMs = 0.0;
+    do {
+        for (const Ray& r : set.rays) fn(r);
+        ops += (long long)set.rays.size();
+        elapsedMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    } while (elapsedMs < minMs);
+
+    double ns = elapsedMs * 1e6 / ops;
+    return {kernel, set.name, ns, 1e9 / ns};
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int rayCount = std::max(16, intOption(argc, argv, "--rays", 4096));
+    double minMs = std::max(1, intOption(argc, argv, "--min-time", 200));
+    std::string filter = stringOption(argc, argv, "--filter", "");
+    std::string jsonPath = stringOption(argc, argv, "--json", "");
+
+    std::vector<Sphere> spheres = {
+        Sphere(Vec3(-1.5f, 0.0f, -5.0f), 1.0f, Vec3(1.0f, 0.0f, 0.0f), 0.5f, 0.0f, 1.0f),
+        Sphere(Vec3(1.5f, 0.0f, -5.0f), 1.0f, Vec3(0.0f, 1.0f, 0.0f), 0.0f, 0.8f, 1.5f),
+        Sphere(Vec3(0.0f, -0.5f, -3.0f), 0.5f, Vec3(0.0f, 0.0f, 1.0f), 0.3f, 0.5f, 1.3f),
+    };
+    Plane plane(Vec3(0, 1, 0), 1.5f, Vec3(1.0f, 1.0f, 1.0f), 0.1f, 0.0f, 1.0f);
+
+    std::vector<Object*> objects = {&spheres[0], &spheres[1], &spheres[2], &plane};
+    std::vector<Sphere> field = makeSphereField(std::max(0, intOption(argc, argv, "--spheres", 0)),
+                                                floatOption(argc, argv, "--glossy", 0.2f));
+    for (auto& s : field) objects.push_back(&s);
+    Scene scene(objects);
+
+    std::vector<Light> lightList = {{kLightPos1}, {Vec3(2, 5, -2)}};
+    std::vector<Light> extraLights = makeLightField(std::max(0, intOption(argc, argv, "--lights", 0)));
+    lightList.insert(lightList.end(), extraLights.begin(), extraLights.end());
+    LightSet lights(lightList);
+    lights.samples = std::max(1, intOption(argc, argv, "--light-samples", lights.samples));
+
+    std::mt19937 rng(2024);
+    std::vector<RaySet> sets;
+    sets.push_back(coherentRays(rayCount));
+    sets.push_back(incoherentRays(rayCount, rng));
+    sets.push_back(grazingRays(rayCount, rng, spheres));
+    sets.push_back(missRays(rayCount, rng));
+    sets.push_back(bounceRays(rayCount, scene));
+    sets.push_back(sortedRays(sets.back(), scene));
+
+    const Object& sphere = spheres[1];
+    const Object& floor = plane;
+    TraceContext ctx;
+    ctx.reserveLights(1);
+
+    using Kernel = std::function<void(const Ray&)>;
+    std::vector<std::pair<std::string, Kernel>> kernels = {
+        {"sphere_intersect", [&](const Ray& r) {
+            float t = 0;
+            Vec3 n, c;
+            if (sphere.intersect(r.orig, r.dir, t, n, c)) sink = sink + t;
+        }},
+        {"sphere_distance", [&](const Ray& r) {
+            const Sphere& s = spheres[1];
+            sink = sink + sphereDistance(s.center.x, s.center.y, s.center.z, s.radius, r.orig, r.dir);
+        }},
+        {"triangle_distance", [&](const Ray& r) {
+            const Vec3& c = spheres[1].center;
+            sink = sink + triangleDistance(c.x - 1, c.y - 1, c.z, 2, 0, 0, 0, 2, 0, r.orig, r.dir);
+        }},
+        {"plane_intersect", [&](const Ray& r) {
+            float t = 0;
+            Vec3 n, c;
+            if (floor.intersect(r.orig, r.dir, t, n, c)) sink = sink + t;
+        }},
+        {"refract", [&](const Ray& r) {
+            Vec3 out;
+            if (refract(r.dir, r.normal, 1.5f, out)) sink = sink + out.x;
+        }},
+        {"fresnel", [&](const Ray& r) {
+            sink = sink + fresnel(r.dir, r.normal, 1.5f);
+        }},
+        {"in_shadow", [&](const Ray& r) {
+            if (inShadow(r.orig, r.normal, kLightPos1, scene, ctx.occluderCache(0))) sink = sink + 1.0f;
+        }},
+        {"scene_intersect", [&](const Ray& r) {
+            Hit hit;
+            if (scene.intersect(r.orig, r.dir, hit)) sink = sink + hit.t;
+        }},
+        {"trace", [&](const Ray& r) {
+            Vec3 c = trace(r.orig, r.dir, scene, lights, 0, 5, ctx);
+            sink = sink + c.x;
+        }},
+    };
+
+    std::vector<Result> results;
+    for (auto& kernel : kernels) {
+        if (!filter.empty() && kernel.first.find(filter) == std::string::npos) continue;
+        for (auto& set : sets) {
+            if (set.rays.empty()) continue; // сцена без попаданий: отражать нечего
+            results.push_back(measure(kernel.first, set, minMs, kernel.second));
+        }
+    }
+
+    // Пакетные ядра имеют смысл только для лучей с общим началом
+    SimdLevel best = detectSimd();
+    for (SimdLevel level : {SimdLevel::SSE, SimdLevel::AVX2}) {
+        if (packetWidth(level) > packetWidth(best)) continue;
+        std::string name = std::string("packet_") + simdName(level);
+        if (!filter.empty() && name.find(filter) == std::string::npos) continue;
+
+        int lanes = packetWidth(level);
+        for (auto& set : sets) {
+            if (set.name != "coherent" && set.name != "all-miss") continue;
+            RaySet trimmed{set.name, std::vector<Ray>(set.rays.begin(), set.rays.begin() + set.rays.size() / lanes * lanes)};
+            RayPacket packet;
+            packet.orig = trimmed.rays[0].orig;
+            int lane = 0;
+            Result r = measure(name, trimmed, minMs, [&](const Ray& ray) {
+                packet.dx[lane] = ray.dir.x;
+                packet.dy[lane] = ray.dir.y;
+                packet.dz[lane] = ray.dir.z;
+                if (++lane == lanes) {
+                    intersectPacket(scene, level, packet);
+                    sink = sink + packet.t[0];
+                    lane = 0;
+                }
+            });
+            results.push_back(r);
+        }
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"simd\": \"" << simdName(best) << "\",\n  \"raysPerSet\": " << rayCount
+         << ",\n  \"spheres\": " << scene.sphereCount() << ",\n  \"lights\": " << lights.count() << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        json << "    {\"kernel\": \"" << r.kernel << "\", \"rays\": \"" << r.raySet
+             << "\", \"nsPerOp\": " << r.nsPerOp << ", \"raysPerSecond\": " << r.raysPerSecond << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+
+    if (jsonPath == "-") {
+        std::cout << json.str();
+        return 0;
+    }
+
+    std::printf("%-18s %-12s %12s %14s\n", "kernel", "rays", "ns/op", "Mrays/s");
+    for (const Result& r : results) {
+        std::printf("%-18s %-12s %12.2f %14.2f\n", r.kernel.c_str(), r.raySet.c_str(), r.nsPerOp, r.raysPerSecond / 1e6);
+    }
+    if (!jsonPath.empty()) std::ofstream(jsonPath) << json.str();
+    return 0;
+}
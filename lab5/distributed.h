@@ -0,0 +1,382 @@
+#pragma once
+
+// Распределённый рендеринг кадра несколькими процессами. Координатор слушает
+// сокет и раздаёт подключившимся исполнителям диапазоны тайлов, исполнители
+// возвращают готовые пиксели тайлов. Сцену каждый исполнитель загружает сам
+// (те же --scene или --spheres, что у координатора), совпадение проверяется
+// по отпечатку сцены. Протокол:
+//   исполнитель -> координатор: kHello (HelloMessage), затем kTile (TileMessage и пиксели)
+//   координатор -> исполнитель: kJob (RenderJob и lightCount записей JobLight), kRange (RangeMessage), kBye (причина отказа или пусто)
+// Диапазоны выдаются по мере готовности, поэтому быстрые исполнители получают
+// больше тайлов. Тайлы отключившегося или замолчавшего исполнителя
+// возвращаются в очередь и выдаются другим.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "raytracer.h"
+#include "renderer.h"
+#include "socket.h"
+
+enum MessageType : std::uint32_t {
+    kHello = 1,
+    kJob,
+    kRange,
+    kTile,
+    kBye,
+};
+
+const std::uint32_t kProtocolVersion = 3;
+
+struct HelloMessage {
+    std::uint32_t version;
+    std::uint32_t threads;
+    std::uint64_t sceneKey;
+};
+
+// Параметры кадра. Тайлы нарезаются makeTiles с kTileSize на обеих сторонах.
+struct RenderJob {
+    std::int32_t width, height, maxDepth;
+    std::int32_t lightCount, lightSamples;
+    std::uint8_t roulette;
+    std::uint8_t toneMap = 0; // ToneMap
+    std::uint8_t pad[2] = {};
+    float minWeight;
+    float exposure = 1.0f;
+};
+
+struct JobLight {
+    Light light;
+    std::uint8_t on;
+    std::uint8_t pad[3] = {};
+};
+
+// Тайлы [begin, end)
+struct RangeMessage {
+    std::int32_t begin, end;
+};
+
+// За заголовком - RGBA-пиксели тайла построчно
+struct TileMessage {
+    std::int32_t index;
+};
+
+const std::uint32_t kMaxMessageSize = sizeof(TileMessage) + kTileSize * kTileSize * 4;
+const int kMaxJobLights = 1 << 20;
+const std::uint32_t kMaxJobSize = sizeof(RenderJob) + kMaxJobLights * sizeof(JobLight);
+
+// Сообщение kJob: параметры кадра и все источники с их состоянием
+inline std::vector<char> encodeJob(RenderJob job, const LightSet& lights) {
+    job.lightCount = lights.count();
+    job.lightSamples = lights.samples;
+    std::vector<char> data(sizeof(job) + lights.count() * sizeof(JobLight));
+    std::memcpy(data.data(), &job, sizeof(job));
+    for (int i = 0; i < lights.count(); i++) {
+        JobLight l;
+        l.light = lights[i];
+        l.on = lights.isOn(i);
+        std::memcpy(data.data() + sizeof(job) + i * sizeof(JobLight), &l, sizeof(l));
+    }
+    return data;
+}
+
+inline bool decodeJob(const std::vector<char>& data, RenderJob& job, LightSet& lights) {
+    if (data.size() < sizeof(job)) return false;
+    std::memcpy(&job, data.data(), sizeof(job));
+    if (job.lightCount < 0 || job.lightCount > kMaxJobLights || job.lightSamples < 1 ||
+        data.size() != sizeof(job) + job.lightCount * sizeof(JobLight)) {
+        return false;
+    }
+    std::vector<JobLight> records(job.lightCount);
+    if (job.lightCount > 0) std::memcpy(records.data(), data.data() + sizeof(job), records.size() * sizeof(JobLight));
+    std::vector<Light> list;
+    for (const JobLight& l : records) list.push_back(l.light);
+    lights = LightSet(list);
+    lights.samples = job.lightSamples;
+    for (int i = 0; i < job.lightCount; i++) lights.setOn(i, records[i].on != 0);
+    return true;
+}
+
+// FNV-1a по данным сцены: одинаковые сцены у координатора и исполнителей
+inline std::uint64_t sceneFingerprint(const Scene& scene) {
+    std::uint64_t h = 1469598103934665603ull;
+    auto add = [&](const void* data, size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) h = (h ^ p[i]) * 1099511628211ull;
+    };
+    auto addArray = [&](const auto& v) {
+        size_t n = v.size();
+        add(&n, sizeof(n));
+        if (n > 0) add(v.data(), n * sizeof(v[0]));
+    };
+    addArray(scene.materials);
+    addArray(scene.sphereX);
+    addArray(scene.sphereY);
+    addArray(scene.sphereZ);
+    addArray(scene.sphereRadius);
+    addArray(scene.sphereMaterial);
+    addArray(scene.planeNX);
+    addArray(scene.planeNY);
+    addArray(scene.planeNZ);
+    addArray(scene.planeD);
+    addArray(scene.planeMaterial);
+    for (const Mesh& mesh : scene.meshes) {
+        addArray(mesh.v0x);
+        addArray(mesh.v0y);
+        addArray(mesh.v0z);
+        addArray(mesh.e1x);
+        addArray(mesh.e1y);
+        addArray(mesh.e1z);
+        addArray(mesh.e2x);
+        addArray(mesh.e2y);
+        addArray(mesh.e2z);
+    }
+    for (const Instance& inst : scene.instances) {
+        add(&inst.mesh, sizeof(inst.mesh));
+        add(&inst.material, sizeof(inst.material));
+        add(inst.toWorld.m, sizeof(inst.toWorld.m));
+    }
+    return h;
+}
+
+struct CoordinatorStats {
+    int workers = 0;       // принятых исполнителей
+    int lostWorkers = 0;   // отключившихся или замолчавших до конца кадра
+    int reissuedTiles = 0; // тайлов, выданных повторно
+    std::vector<int> tilesPerWorker;
+};
+
+// Собирает кадр job с источниками lights в pixels (RGBA, width * height * 4) от исполнителей,
+// подключающихся к listener. Исполнитель, который держит невыполненные тайлы
+// и молчит дольше timeoutMs, считается погибшим. Возвращает false только при
+// ошибке самого сокета; пока тайлы не готовы, ждёт новых исполнителей.
+inline bool coordinateFrame(int listener, const RenderJob& job, const LightSet& lights, std::uint64_t sceneKey, int timeoutMs,
+                            std::vector<std::uint8_t>& pixels, CoordinatorStats& stats, std::string& error) {
+    using Clock = std::chrono::steady_clock;
+
+    struct Worker {
+        int fd = -1;
+        int id = -1; // номер в stats.tilesPerWorker после kHello
+        int threads = 1;
+        std::vector<int> owned; // выданные, но ещё не полученные тайлы
+        Clock::time_point lastHeard;
+    };
+
+    std::vector<Tile> tiles = makeTiles(job.width, job.height, kTileSize);
+    const std::vector<char> jobMessage = encodeJob(job, lights);
+    std::vector<char> received(tiles.size(), 0);
+    int receivedCount = 0;
+    std::deque<int> pending;
+    for (int i = 0; i < (int)tiles.size(); i++) pending.push_back(i);
+    std::vector<Worker> workers;
+
+    auto drop = [&](size_t w, const char* reason) {
+        Worker& worker = workers[w];
+        int returned = 0;
+        for (auto it = worker.owned.rbegin(); it != worker.owned.rend(); ++it) {
+            if (received[*it]) continue;
+            pending.push_front(*it);
+            returned++;
+        }
+        if (worker.id >= 0) {
+            std::cerr << "Worker " << worker.id << " " << reason << ", " << returned << " tiles reissued" << std::endl;
+            stats.lostWorkers++;
+            stats.reissuedTiles += returned;
+        }
+        ::close(worker.fd);
+        workers.erase(workers.begin() + w);
+    };
+
+    // Держит у исполнителя около двух порций тайлов, чтобы он не простаивал
+    // в ожидании следующего диапазона. Порция уменьшается к концу кадра,
+    // чтобы хвост распределился между всеми.
+    auto assign = [&](Worker& worker) {
+        int ready = 0;
+        for (const Worker& w : workers) ready += w.id >= 0;
+        int batch = 2 * worker.threads;
+        while ((int)worker.owned.size() < batch && !pending.empty()) {
+            int chunk = std::max(1, std::min(batch, (int)pending.size() / (2 * std::max(1, ready))));
+            RangeMessage range = {pending.front(), pending.front()};
+            while (!pending.empty() && pending.front() == range.end && range.end - range.begin < chunk) {
+                worker.owned.push_back(range.end++);
+                pending.pop_front();
+            }
+            if (worker.owned.size() == (size_t)(range.end - range.begin)) worker.lastHeard = Clock::now();
+            if (!sendMessage(worker.fd, kRange, &range, sizeof(range))) return false;
+        }
+        return true;
+    };
+
+    auto handle = [&](Worker& worker) {
+        std::uint32_t type;
+        std::vector<char> data;
+        if (!recvMessage(worker.fd, type, data, kMaxMessageSize)) return false;
+        worker.lastHeard = Clock::now();
+
+        if (type == kHello && worker.id < 0 && data.size() == sizeof(HelloMessage)) {
+            HelloMessage hello;
+            std::memcpy(&hello, data.data(), sizeof(hello));
+            const char* reject = hello.version != kProtocolVersion ? "protocol version mismatch"
+                               : hello.sceneKey != sceneKey ? "scene mismatch" : nullptr;
+            if (reject) {
+                sendMessage(worker.fd, kBye, reject, std::strlen(reject));
+                std::cerr << "Rejected worker: " << reject << std::endl;
+                return false;
+            }
+            worker.id = stats.workers++;
+            worker.threads = std::max(1, (int)hello.threads);
+            stats.tilesPerWorker.push_back(0);
+            return sendMessage(worker.fd, kJob, jobMessage.data(), jobMessage.size()) && assign(worker);
+        }
+
+        if (type == kTile && worker.id >= 0 && data.size() >= sizeof(TileMessage)) {
+            TileMessage header;
+            std::memcpy(&header, data.data(), sizeof(header));
+            auto it = std::find(worker.owned.begin(), worker.owned.end(), header.index);
+            if (it == worker.owned.end()) return false;
+            const Tile& tile = tiles[header.index];
+            size_t rowBytes = (size_t)(tile.x1 - tile.x0) * 4;
+            if (data.size() != sizeof(header) + rowBytes * (tile.y1 - tile.y0)) return false;
+            worker.owned.erase(it);
+            if (!received[header.index]) {
+                const char* src = data.data() + sizeof(header);
+                for (int y = tile.y0; y < tile.y1; y++, src += rowBytes) {
+                    std::memcpy(&pixels[((size_t)y * job.width + tile.x0) * 4], src, rowBytes);
+                }
+                received[header.index] = 1;
+                receivedCount++;
+                stats.tilesPerWorker[worker.id]++;
+            }
+            return assign(worker);
+        }
+        return false;
+    };
+
+    std::vector<pollfd> fds;
+    while (receivedCount < (int)tiles.size()) {
+        fds.assign(1, pollfd{listener, POLLIN, 0});
+        for (const Worker& w : workers) fds.push_back(pollfd{w.fd, POLLIN, 0});
+        if (::poll(fds.data(), fds.size(), 200) < 0 && errno != EINTR) {
+            error = std::string("poll: ") + std::strerror(errno);
+            return false;
+        }
+
+        // Обход с конца: drop удаляет исполнителя из workers
+        for (size_t w = workers.size(); w-- > 0;) {
+            if (fds[w + 1].revents == 0) continue;
+            if (!handle(workers[w])) drop(w, "disconnected");
+        }
+
+        auto now = Clock::now();
+        for (size_t w = workers.size(); w-- > 0;) {
+            bool waiting = workers[w].id < 0 || !workers[w].owned.empty();
+            if (waiting && now - workers[w].lastHeard > std::chrono::milliseconds(timeoutMs)) drop(w, "timed out");
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                // Исполнитель, замолчавший посреди сообщения, не блокирует координатор
+                setReceiveTimeout(fd, timeoutMs);
+                Worker worker;
+                worker.fd = fd;
+                worker.lastHeard = Clock::now();
+                workers.push_back(worker);
+            }
+        }
+
+        // Тайлы погибших исполнителей - тем, кто уже работает
+        for (size_t w = workers.size(); w-- > 0;) {
+            if (workers[w].id >= 0 && !pending.empty() && !assign(workers[w])) drop(w, "disconnected");
+        }
+    }
+
+    for (Worker& w : workers) {
+        if (w.id >= 0) sendMessage(w.fd, kBye, nullptr, 0);
+        ::close(w.fd);
+    }
+    return true;
+}
+
+// Исполнитель: подключается к координатору, трассирует выданные тайлы своим
+// Renderer и отправляет их до сообщения kBye. failAfter > 0 - аварийный выход
+// после стольких отправленных тайлов, для проверки повторной выдачи.
+inline bool serveWorker(int fd, const Scene& scene, int threads, SimdLevel simd, int failAfter,
+                        int& tilesSent, std::string& error) {
+    HelloMessage hello = {kProtocolVersion, (std::uint32_t)threads, sceneFingerprint(scene)};
+    if (!sendMessage(fd, kHello, &hello, sizeof(hello))) {
+        error = "cannot send hello";
+        return false;
+    }
+
+    std::unique_ptr<Renderer> renderer;
+    std::vector<char> data, tile;
+    tilesSent = 0;
+    for (;;) {
+        std::uint32_t type;
+        if (!recvMessage(fd, type, data, std::max(kMaxMessageSize, kMaxJobSize))) {
+            error = "connection to coordinator lost";
+            return false;
+        }
+
+        if (type == kBye) {
+            if (data.empty()) return true;
+            error = "rejected by coordinator: " + std::string(data.begin(), data.end());
+            return false;
+        }
+
+        if (type == kJob && !renderer) {
+            RenderJob job;
+            LightSet lights;
+            if (!decodeJob(data, job, lights) || job.width <= 0 || job.height <= 0 || job.maxDepth < 0) {
+                error = "bad job";
+                return false;
+            }
+            renderer.reset(new Renderer(scene, job.width, job.height, job.maxDepth, threads, simd));
+            renderer->lights = std::move(lights);
+            renderer->setPruning(job.minWeight, job.roulette != 0);
+            renderer->toneMap = (ToneMap)std::min<int>(job.toneMap, (int)ToneMap::ACES);
+            renderer->exposure = job.exposure;
+            continue;
+        }
+
+        RangeMessage range;
+        if (type != kRange || !renderer || data.size() != sizeof(range)) {
+            error = "unexpected message " + std::to_string(type);
+            return false;
+        }
+        std::memcpy(&range, data.data(), sizeof(range));
+        if (range.begin < 0 || range.end > renderer->tileCount() || range.begin >= range.end) {
+            error = "bad tile range";
+            return false;
+        }
+
+        renderer->renderTiles(range.begin, range.end);
+        for (int t = range.begin; t < range.end; t++) {
+            const Tile& r = renderer->tile(t);
+            size_t bytes = (size_t)(r.x1 - r.x0) * (r.y1 - r.y0) * 4;
+            TileMessage header = {t};
+            tile.resize(sizeof(header) + bytes);
+            std::memcpy(tile.data(), &header, sizeof(header));
+            // Кадр исполнителя разложен по тайлам: строки тайла уже идут подряд
+            std::memcpy(tile.data() + sizeof(header), renderer->tilePixels(r), bytes);
+            if (!sendMessage(fd, kTile, tile.data(), tile.size())) {
+                error = "connection to coordinator lost";
+                return false;
+            }
+            if (++tilesSent == failAfter) std::_Exit(3);
+        }
+    }
+}
@@ -1,246 +1,607 @@
 #include <SFML/Graphics.hpp>
-#include <cmath>
-#include <vector>
-#include <limits>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
-struct Vec3 {
-    float x, y, z;
-    Vec3(float x_ = 0, float y_ = 0, float z_ = 0) : x(x_), y(y_), z(z_) {}
+#include "animation.h"
+#include "distributed.h"
+#include "options.h"
+#include "perfcounters.h"
+#include "raytracer.h"
+#include "renderer.h"
+#include "scenefile.h"
+
+// Выделения памяти через operator new во всей программе. Отчёт --headless
+// показывает, сколько их приходится на кадр после первого.
+std::atomic<std::uint64_t> allocationCount{0};
+
+void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Фоновый прогрессивный рендеринг для окна. restart() прерывает текущий кадр
+// и начинает новый с грубого прохода; каждый завершённый проход копируется
+// в буфер, который основной поток забирает через takeFrame().
+class ProgressiveJob {
+public:
+    explicit ProgressiveJob(Renderer& renderer_) : renderer(renderer_), thread([this] { run(); }) {}
+
+    ~ProgressiveJob() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cancel = true;
+        wake.notify_all();
+        thread.join();
+    }
 
-    Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
-    Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
-    Vec3 operator*(float f) const { return Vec3(x * f, y * f, z * f); }
-    Vec3 operator/(float f) const { return Vec3(x / f, y / f, z / f); }
-    Vec3 operator*(const Vec3& v) const { return Vec3(x * v.x, y * v.y, z * v.z); }
+    ProgressiveJob(const ProgressiveJob&) = delete;
+    ProgressiveJob& operator=(const ProgressiveJob&) = delete;
+
+    // lightsOn - состояние каждого источника;
+    // lightsOnly: изменились только источники, кадр можно собрать из слоёв
+    void restart(const std::vector<char>& lightsOn, bool lightsOnly) {
+        std::lock_guard<std::mutex> lock(mutex);
+        request.lightsOn = lightsOn;
+        // Несколько перезапусков подряд: полный кадр нужен, если его требовал хоть один
+        request.lightsOnly = hasRequest ? (request.lightsOnly && lightsOnly) : lightsOnly;
+        hasRequest = true;
+        cancel = true;
+        wake.notify_all();
+    }
 
-    float dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
-    Vec3 cross(const Vec3& v) const {
-        return Vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+    // Копирует в out последний готовый проход, если он новее уже забранного
+    bool takeFrame(std::vector<std::uint8_t>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!frameReady) return false;
+        out = frame;
+        frameReady = false;
+        return true;
     }
 
-    float length() const { return std::sqrt(dot(*this)); }
-    Vec3 normalize() const { 
-        float len = length(); 
-        return len > 0 ? (*this) * (1.0f / len) : *this; 
+private:
+    struct Request {
+        std::vector<char> lightsOn;
+        bool lightsOnly = false;
+    };
+
+    void publish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        renderer.copyPixels(frame);
+        frameReady = true;
     }
-};
 
-struct Object {
-    virtual ~Object() {}
-    virtual bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const = 0;
+    void run() {
+        for (;;) {
+            Request r;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || hasRequest; });
+                if (stopping) return;
+                r = request;
+                hasRequest = false;
+                cancel = false;
+            }
 
-    float reflection = 0.0f;
-    float refraction = 0.0f;
-    float ior = 1.0f; // Индекс преломления
-};
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < r.lightsOn.size(); i++) renderer.lights.setOn((int)i, r.lightsOn[i] != 0);
+            if (r.lightsOnly && renderer.hasLayers()) {
+                renderer.composite();
+                publish();
+            } else if (!renderer.renderProgressive(cancel, [this] { publish(); })) {
+                continue;
+            }
+            auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+            std::cout << "Progressive frame: " << elapsed.count() << " ms" << std::endl;
+        }
+    }
 
-struct Sphere : public Object {
-    Vec3 center;
-    float radius;
-    Vec3 color;
+    Renderer& renderer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> cancel{false};
+    Request request;
+    bool hasRequest = false;
+    bool stopping = false;
+    std::vector<std::uint8_t> frame;
+    bool frameReady = false;
+    std::thread thread;
+};
 
-    Sphere(const Vec3& c, float r, const Vec3& col, float refl = 0.0f, float refr = 0.0f, float ior_ = 1.0f) {
-        center = c;
-        radius = r;
-        color = col;
-        reflection = refl;
-        refraction = refr;
-        ior = ior_;
+// Регулятор разрешения окна: по последним длительностям полной трассировки
+// подбирает масштаб внутреннего разрешения, чтобы кадр укладывался в budgetMs.
+// Время трассировки примерно пропорционально числу пикселей, то есть квадрату
+// масштаба. Масштаб квантуется и меняется, только если кадр вышел за бюджет
+// или заметно не дотянул до него, чтобы буферы не перестраивались каждый кадр.
+class ResolutionGovernor {
+public:
+    ResolutionGovernor(double budgetMs_, float minScale_)
+        : budgetMs(budgetMs_), minScale(std::max(0.05f, std::min(1.0f, minScale_))) {}
+
+    bool enabled() const { return budgetMs > 0.0; }
+    float scale() const { return current; }
+
+    // Учитывает длительность кадра с текущим масштабом; true, если масштаб изменился
+    bool update(double ms) {
+        const size_t kHistory = 3;
+        const float kStep = 0.05f;
+        if (!enabled()) return false;
+        recent.push_back(ms);
+        if (recent.size() > kHistory) recent.pop_front();
+
+        std::vector<double> sorted(recent.begin(), recent.end());
+        std::sort(sorted.begin(), sorted.end());
+        double typical = sorted[sorted.size() / 2];
+        if (typical <= budgetMs && (typical >= 0.7 * budgetMs || current >= 1.0f)) return false;
+
+        // Цель - 90% бюджета, чтобы колебания времени не выводили за него
+        float target = current * (float)std::sqrt(0.9 * budgetMs / std::max(typical, 1e-3));
+        target = std::max(minScale, std::min(1.0f, std::round(target / kStep) * kStep));
+        if (std::abs(target - current) < kStep * 0.5f) return false;
+        current = target;
+        recent.clear();
+        return true;
     }
 
-    bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const override {
-        Vec3 L = center - orig;
-        float tca = L.dot(dir);
-        if (tca < 0) return false;
+private:
+    double budgetMs;
+    float minScale;
+    float current = 1.0f;
+    std::deque<double> recent;
+};
 
-        float d2 = L.dot(L) - tca * tca;
-        float r2 = radius * radius;
-        if (d2 > r2) return false;
+// Запись RGBA-буфера в двоичный PPM (P6), альфа-канал отбрасывается
+bool writePPM(const std::string& path, int width, int height, const std::vector<std::uint8_t>& rgba) {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    std::fprintf(f, "P6\n%d %d\n255\n", width, height);
+    std::vector<std::uint8_t> rgb((size_t)width * height * 3);
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        rgb[i * 3 + 0] = rgba[i * 4 + 0];
+        rgb[i * 3 + 1] = rgba[i * 4 + 1];
+        rgb[i * 3 + 2] = rgba[i * 4 + 2];
+    }
+    bool ok = std::fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+    return std::fclose(f) == 0 && ok;
+}
 
-        float thc = std::sqrt(r2 - d2);
-        float t0 = tca - thc;
-        float t1 = tca + thc;
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
+// PPM пишется напрямую, остальные форматы (PNG и т.д.) - через sf::Image
+bool writeImage(const std::string& path, int width, int height, const std::vector<std::uint8_t>& rgba) {
+    if (endsWith(path, ".ppm")) return writePPM(path, width, height, rgba);
+    sf::Image image;
+    image.create(width, height, rgba.data());
+    return image.saveToFile(path);
+}
 
-        tNear = t0;
-        Vec3 phit = orig + dir * tNear;
-        hitNormal = (phit - center).normalize();
-        hitColor = color;
+// Вставляет suffix перед расширением файла: frame.ppm -> frame_suffix.ppm
+std::string insertSuffix(const std::string& path, const std::string& suffix) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos) dot = path.size();
+    return path.substr(0, dot) + "_" + suffix + path.substr(dot);
+}
 
-        return true;
+// Рендеринг без окна: frames кадров подряд, запись последнего кадра в файл
+// и отчёт о времени в JSON (в stdout или в файл --report). С --heatmap рядом
+// с кадром записывается тепловая карта времени трассировки тайлов. Счётчики
+// кэша perf и выделений памяти считают только трассировку кадров; с
+// --check-allocations код возврата 1, если кадры после первого выделяли память.
+int runHeadless(Renderer& renderer, PerfCounters& perf, int argc, char** argv, double buildMs, const char* simd,
+                int maxDepth) {
+    // По умолчанию кадров столько, сколько накапливается
+    int frames = std::max(1, intOption(argc, argv, "--frames", renderer.accumulate));
+    std::string output = stringOption(argc, argv, "--output", "");
+    std::string reportPath = stringOption(argc, argv, "--report", "");
+    bool heatmap = flagOption(argc, argv, "--heatmap");
+
+    std::vector<double> frameMs, tailMs;
+    double traceMs = 0.0, compositeMs = 0.0;
+    std::uint64_t rays = 0, pruned = 0;
+    double samples = 0.0;
+    RayStats stats;
+    std::vector<std::uint64_t> allocations(frames);
+    perf.start();
+    for (int i = 0; i < frames; i++) {
+        renderer.resetStats();
+        auto start = std::chrono::steady_clock::now();
+        std::uint64_t allocatedBefore = allocationCount.load();
+        renderer.render();
+        allocations[i] = allocationCount.load() - allocatedBefore;
+        frameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        tailMs.push_back(renderer.tailMs);
+        traceMs += renderer.traceMs;
+        compositeMs += renderer.compositeMs;
+        rays += renderer.rayCount();
+        pruned += renderer.prunedCount();
+        samples += renderer.samplesPerPixel();
+        stats.merge(renderer.rayStats());
     }
-};
-
-struct Plane : public Object {
-    Vec3 normal;
-    float d;
-    Vec3 color;
-
-    Plane(const Vec3& n, float d_, const Vec3& col, float refl = 0.0f, float refr = 0.0f, float ior_ = 1.0f) {
-        normal = n.normalize();
-        d = d_;
-        color = col;
-        reflection = refl;
-        refraction = refr;
-        ior = ior_;
-    }
-
-    bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const override {
-        float denom = normal.dot(dir);
-        if (std::fabs(denom) > 1e-6) {
-            float t = -(normal.dot(orig) + d) / denom;
-            if (t >= 0) {
-                tNear = t;
-                hitNormal = normal;
-                hitColor = color;
-                return true;
-            }
+    perf.stop();
+
+    double writeMs = 0.0;
+    if (!output.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::uint8_t> image;
+        renderer.copyPixels(image);
+        if (!writeImage(output, renderer.frameWidth(), renderer.frameHeight(), image)) {
+            std::cerr << "Failed to write " << output << std::endl;
+            return 1;
+        }
+        writeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (heatmap) {
+        std::string heatmapPath = output.empty() ? "heatmap.ppm" : insertSuffix(output, "heatmap");
+        if (!writeImage(heatmapPath, renderer.frameWidth(), renderer.frameHeight(), renderer.costHeatmap())) {
+            std::cerr << "Failed to write " << heatmapPath << std::endl;
+            return 1;
         }
-        return false;
     }
-};
-
-bool refract(const Vec3& I, const Vec3& N, float ior, Vec3& refrDir) {
-    float cosi = std::clamp(I.dot(N), -1.0f, 1.0f);
-    float etai = 1.0f, etat = ior;
-    Vec3 n = N;
 
-    if (cosi < 0) {
-        cosi = -cosi;
+    double totalMs = 0.0;
+    for (double ms : frameMs) totalMs += ms;
+    double minMs = *std::min_element(frameMs.begin(), frameMs.end());
+    double maxMs = *std::max_element(frameMs.begin(), frameMs.end());
+    // Первый кадр всегда планируется без замеров, остальные - по стоимости
+    // тайлов предыдущего кадра (если не --schedule static)
+    double laterTailMs = 0.0;
+    for (int i = 1; i < frames; i++) laterTailMs += tailMs[i];
+    const std::vector<double>& tileMs = renderer.tileTimes();
+    double tileTotalMs = 0.0;
+    for (double ms : tileMs) tileTotalMs += ms;
+    std::uint64_t laterAllocations = 0;
+    for (int i = 1; i < frames; i++) laterAllocations += allocations[i];
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"width\": " << renderer.frameWidth() << ",\n"
+         << "  \"height\": " << renderer.frameHeight() << ",\n"
+         << "  \"maxDepth\": " << maxDepth << ",\n"
+         << "  \"threads\": " << renderer.threadCount() << ",\n"
+         << "  \"simd\": \"" << simd << "\",\n"
+         << "  \"engine\": \"" << engineName(renderer.engine) << "\",\n"
+         << "  \"sortRays\": " << (renderer.sortRays ? "true" : "false") << ",\n"
+         << "  \"traversal\": \"" << (renderer.traversal == Traversal::ZOrder ? "zorder" : "rows") << "\",\n"
+         << "  \"toneMap\": \"" << toneMapName(renderer.toneMap) << "\",\n"
+         << "  \"exposure\": " << renderer.exposure << ",\n"
+         << "  \"frames\": " << frames << ",\n"
+         << "  \"accumulatedFrames\": " << renderer.accumulatedFrames() << ",\n"
+         << "  \"rays\": " << rays << ",\n"
+         << "  \"prunedRays\": " << pruned << ",\n"
+         << "  \"samplesPerPixel\": " << samples / frames << ",\n"
+         << "  \"raysPerSecond\": " << (totalMs > 0 ? rays / (totalMs / 1000.0) : 0.0) << ",\n"
+         << "  \"msPerFrame\": {\"mean\": " << totalMs / frames << ", \"min\": " << minMs << ", \"max\": " << maxMs << "},\n"
+         << "  \"allocations\": {\"first\": " << allocations[0] << ", \"later\": " << laterAllocations << "},\n"
+         << "  \"tailMs\": {\"first\": " << tailMs[0] << ", \"laterMean\": " << (frames > 1 ? laterTailMs / (frames - 1) : 0.0) << "},\n"
+         << "  \"tileMs\": {\"mean\": " << tileTotalMs / tileMs.size()
+         << ", \"min\": " << *std::min_element(tileMs.begin(), tileMs.end())
+         << ", \"max\": " << *std::max_element(tileMs.begin(), tileMs.end()) << "},\n"
+         << "  \"phasesMs\": {\"build\": " << buildMs << ", \"trace\": " << traceMs
+         << ", \"composite\": " << compositeMs << ", \"write\": " << writeMs << "}";
+    json << ",\n  \"perfCounters\": ";
+    if (perf.any()) {
+        const char* separator = "{";
+        for (int i = 0; i < PerfCounters::kCount; i++) {
+            if (!perf.ok(i)) continue;
+            json << separator << "\"" << PerfCounters::name(i) << "\": " << perf.value(i);
+            separator = ", ";
+        }
+        json << "}";
     } else {
-        std::swap(etai, etat);
-        n = n * -1.0f;
+        json << "null";
     }
-
-    float eta = etai / etat;
-    float k = 1 - eta * eta * (1 - cosi * cosi);
-
-    if (k < 0) {
-        return false;
+#if defined(LAB5_RAY_STATS)
+    json << ",\n  \"rayStats\": {\"primary\": " << stats.primary << ", \"shadow\": " << stats.shadow
+         << ", \"reflection\": " << stats.reflection << ", \"refraction\": " << stats.refraction
+         << ", \"boxTests\": " << stats.boxTests << ", \"primitiveTests\": " << stats.primitiveTests
+         << ", \"maxDepth\": " << stats.maxDepth << "}";
+#endif
+    json << "\n}\n";
+
+    if (reportPath.empty()) {
+        std::cout << json.str();
     } else {
-        refrDir = I * eta + n * (eta * cosi - std::sqrt(k));
-        return true;
+        std::ofstream(reportPath) << json.str();
+    }
+    if (flagOption(argc, argv, "--check-allocations") && laterAllocations > 0) {
+        std::cerr << laterAllocations << " allocations after the first frame" << std::endl;
+        return 1;
     }
+    return 0;
 }
 
-float fresnel(const Vec3& I, const Vec3& N, float ior) {
-    float cosi = std::clamp(I.dot(N), -1.0f, 1.0f);
-    float etai = 1, etat = ior;
+// Сравнение трассировщиков (--compare-engines): кадр трассируется рекурсивным
+// и волновым способом, в JSON выводятся время каждого и число различающихся
+// пикселей. Код возврата 1, если изображения различаются.
+int runEngineCompare(Renderer& renderer, int argc, char** argv) {
+    std::string reportPath = stringOption(argc, argv, "--report", "");
+    const TraceEngine engines[2] = {TraceEngine::Recursive, TraceEngine::Wavefront};
+    std::vector<std::uint8_t> images[2];
+    double ms[2];
+    for (int i = 0; i < 2; i++) {
+        renderer.engine = engines[i];
+        renderer.resetStats();
+        auto start = std::chrono::steady_clock::now();
+        renderer.renderAccumulated();
+        ms[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        renderer.copyPixels(images[i]);
+    }
 
-    if (cosi > 0) std::swap(etai, etat);
+    std::uint64_t different = 0;
+    int maxDifference = 0;
+    for (size_t p = 0; p < images[0].size(); p += 4) {
+        int d = 0;
+        for (int c = 0; c < 3; c++) d = std::max(d, std::abs(images[0][p + c] - images[1][p + c]));
+        different += d > 0;
+        maxDifference = std::max(maxDifference, d);
+    }
 
-    float sint = etai / etat * std::sqrt(std::max(0.f, 1 - cosi * cosi));
-    if (sint >= 1) {
-        return 1.0f;
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"width\": " << renderer.frameWidth() << ",\n"
+         << "  \"height\": " << renderer.frameHeight() << ",\n"
+         << "  \"recursiveMs\": " << ms[0] << ",\n"
+         << "  \"wavefrontMs\": " << ms[1] << ",\n"
+         << "  \"differentPixels\": " << different << ",\n"
+         << "  \"maxDifference\": " << maxDifference << "\n"
+         << "}\n";
+    if (reportPath.empty()) {
+        std::cout << json.str();
     } else {
-        float cost = std::sqrt(std::max(0.f, 1 - sint * sint));
-        cosi = std::fabs(cosi);
-
-        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-        return (Rs * Rs + Rp * Rp) * 0.5f;
+        std::ofstream(reportPath) << json.str();
     }
+    return different == 0 ? 0 : 1;
 }
 
-bool inShadow(const Vec3& phit, const Vec3& nhit, const Vec3& lightPos, const std::vector<Object*>& objects) {
-    Vec3 lightDir = (lightPos - phit).normalize();
-    for (auto obj : objects) {
-        float t = std::numeric_limits<float>::infinity();
-        Vec3 n, c;
-        if (obj->intersect(phit + nhit * 1e-4f, lightDir, t, n, c)) {
-            return true; // Точка находится в тени
-        }
+// Очередь ограниченной длины между стадиями конвейера: push ждёт, пока
+// освободится место, pop - пока появится элемент или очередь закроют
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity_) : capacity(capacity_) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
     }
-    return false; // Точка освещена
-}
 
-Vec3 trace(const Vec3& orig, const Vec3& dir, const std::vector<Object*>& objects,
-           const Vec3& lightPos1, const Vec3& lightPos2, bool light1On, bool light2On,
-           int depth, int maxDepth) {
-    if (depth > maxDepth) {
-        return Vec3(0, 0, 0);
-    }
-
-    float tNear = std::numeric_limits<float>::infinity();
-    const Object* hitObject = nullptr;
-    Vec3 hitNormal, hitColor;
-
-    for (auto obj : objects) {
-        float t = std::numeric_limits<float>::infinity();
-        Vec3 n, c;
-        if (obj->intersect(orig, dir, t, n, c)) {
-            if (t < tNear) {
-                tNear = t;
-                hitObject = obj;
-                hitNormal = n;
-                hitColor = c;
-            }
-        }
+    // false, если очередь закрыта и пуста
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
     }
 
-    if (!hitObject) {
-        return Vec3(0.2f, 0.7f, 1.0f); // Цвет неба
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
     }
 
-    Vec3 phit = orig + dir * tNear;
-    Vec3 nhit = hitNormal;
-
-    float refl = hitObject->reflection;
-    float refr = hitObject->refraction;
-    float ior = hitObject->ior;
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+};
 
-    Vec3 surfaceColor(0, 0, 0);
+// Имя файла кадра: %d или %0Nd в шаблоне заменяется номером кадра,
+// без них номер вставляется перед расширением
+std::string frameName(const std::string& pattern, int index) {
+    size_t percent = pattern.find('%');
+    if (percent != std::string::npos) {
+        size_t d = pattern.find_first_not_of("0123456789", percent + 1);
+        if (d != std::string::npos && pattern[d] == 'd') {
+            int width = d > percent + 1 ? std::atoi(pattern.c_str() + percent + 1) : 0;
+            std::string number = std::to_string(index);
+            if ((int)number.size() < width) number.insert(0, width - number.size(), '0');
+            return pattern.substr(0, percent) + number + pattern.substr(d + 1);
+        }
+    }
+    return insertSuffix(pattern, std::to_string(index));
+}
 
-    auto computeLight = [&](const Vec3& lightPos, bool lightOn) {
-        if (!lightOn) return Vec3(0, 0, 0); 
+// Последовательность кадров по анимации (--sequence). Пока кадр N кодируется
+// и записывается в отдельном потоке, трассируется кадр N + 1. Между стадиями -
+// очередь на --queue кадров, а буферы кадров переиспользуются, так что память
+// не растёт с длиной последовательности. Перевод в 8 бит выполняет ещё
+// рендерер, на стадии кодирования остаются сжатие и запись файла.
+// Кадр 0 - сцена с положениями ключей кадра 0, а не сцена из файла как есть;
+// для сверки с отдельным кадром есть --headless --animation файл --at-frame N.
+int runSequence(Renderer& renderer, Scene& scene, int argc, char** argv) {
+    std::string animPath = stringOption(argc, argv, "--sequence", "");
+    std::string pattern = stringOption(argc, argv, "--output", "frame%04d.ppm");
+    std::string reportPath = stringOption(argc, argv, "--report", "");
+    int queueDepth = std::max(1, intOption(argc, argv, "--queue", 2));
+
+    Animation anim;
+    std::string error;
+    if (!loadAnimation(animPath, scene, renderer.lights.count(), anim, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
 
-        Vec3 lightDir = (lightPos - phit).normalize();
-        bool shadow = inShadow(phit, nhit, lightPos, objects);
-        float shade = shadow ? 0.2f : std::max(0.0f, nhit.dot(lightDir));
-        return hitColor * shade;
+    struct Frame {
+        int index = 0;
+        std::vector<std::uint8_t> rgba;
     };
+    // Кадр в очереди, по одному у каждой стадии
+    BoundedQueue<Frame> encodeQueue(queueDepth), freeFrames(queueDepth + 2);
+    for (int i = 0; i < queueDepth + 2; i++) freeFrames.push(Frame{0, std::vector<std::uint8_t>((size_t)renderer.frameWidth() * renderer.frameHeight() * 4)});
 
-    surfaceColor = computeLight(lightPos1, light1On) + computeLight(lightPos2, light2On);
-
-    // Обработка отражений и преломлений
-    if (refl > 0.0f || refr > 0.0f) {
-        float kr = fresnel(dir, nhit, ior); // Коэффициент отражения
-
-        Vec3 reflectionColor(0, 0, 0);
-        Vec3 refractionColor(0, 0, 0);
-
-        if (refl > 0.0f) {
-            Vec3 reflDir = dir - nhit * 2.0f * (dir.dot(nhit));
-            reflDir = reflDir.normalize();
-            reflectionColor = trace(phit + nhit * 1e-4f, reflDir, objects, lightPos1, lightPos2, light1On, light2On, depth + 1, maxDepth);
-        }
+    auto ms = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    };
 
-        if (refr > 0.0f) {
-            Vec3 refrDir;
-            if (refract(dir, nhit, ior, refrDir)) {
-                refrDir = refrDir.normalize();
-                refractionColor = trace(phit - nhit * 1e-4f, refrDir, objects, lightPos1, lightPos2, light1On, light2On, depth + 1, maxDepth);
+    std::atomic<bool> writeFailed{false};
+    double encodeMs = 0.0;
+    std::thread encoder([&] {
+        Frame f;
+        while (encodeQueue.pop(f)) {
+            auto start = std::chrono::steady_clock::now();
+            std::string name = frameName(pattern, f.index);
+            if (!writeFailed && !writeImage(name, renderer.frameWidth(), renderer.frameHeight(), f.rgba)) {
+                std::cerr << "Failed to write " << name << std::endl;
+                writeFailed = true;
             }
+            encodeMs += ms(start);
+            freeFrames.push(std::move(f));
         }
+    });
+
+    double animateMs = 0.0, traceMs = 0.0, stallMs = 0.0;
+    auto wallStart = std::chrono::steady_clock::now();
+    int frame = 0;
+    for (; frame < anim.frames && !writeFailed; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        anim.apply(frame, scene, renderer.lights);
+        animateMs += ms(start);
+
+        // Накопленное относится к прошлому состоянию сцены
+        start = std::chrono::steady_clock::now();
+        renderer.renderAccumulated();
+        traceMs += ms(start);
+
+        // Ожидание свободного буфера означает, что кодирование не успевает за трассировкой
+        start = std::chrono::steady_clock::now();
+        Frame f;
+        freeFrames.pop(f);
+        stallMs += ms(start);
+        f.index = frame;
+        renderer.copyPixels(f.rgba);
+        encodeQueue.push(std::move(f));
+    }
+    encodeQueue.close();
+    encoder.join();
+    double wallMs = ms(wallStart);
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"frames\": " << frame << ",\n"
+         << "  \"width\": " << renderer.frameWidth() << ",\n"
+         << "  \"height\": " << renderer.frameHeight() << ",\n"
+         << "  \"threads\": " << renderer.threadCount() << ",\n"
+         << "  \"queue\": " << queueDepth << ",\n"
+         << "  \"wallMs\": " << wallMs << ",\n"
+         << "  \"framesPerSecond\": " << (wallMs > 0 ? frame / (wallMs / 1000.0) : 0.0) << ",\n"
+         << "  \"phasesMs\": {\"animate\": " << animateMs << ", \"trace\": " << traceMs
+         << ", \"encode\": " << encodeMs << ", \"traceStall\": " << stallMs << "}\n"
+         << "}\n";
+
+    if (reportPath.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(reportPath) << json.str();
+    }
+    return writeFailed ? 1 : 0;
+}
+
+// Координатор распределённого рендеринга (--coordinator адрес): ждёт
+// исполнителей, собирает от них кадр, записывает его в --output и выводит
+// отчёт в JSON. Сам координатор не трассирует.
+int runCoordinator(const Scene& scene, const RenderJob& job, const LightSet& lights, int argc, char** argv) {
+    std::string address = stringOption(argc, argv, "--coordinator", "");
+    std::string output = stringOption(argc, argv, "--output", "");
+    std::string reportPath = stringOption(argc, argv, "--report", "");
+    int timeoutMs = std::max(100, intOption(argc, argv, "--worker-timeout", 30000));
+
+    std::string error;
+    int listener = listenSocket(address, error);
+    if (listener < 0) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << "Waiting for workers on " << address << std::endl;
+
+    std::vector<std::uint8_t> pixels((size_t)job.width * job.height * 4, 0);
+    CoordinatorStats stats;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = coordinateFrame(listener, job, lights, sceneFingerprint(scene), timeoutMs, pixels, stats, error);
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ::close(listener);
+    if (!ok) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
 
-        Vec3 result = reflectionColor * kr * refl + refractionColor * (1.0f - kr) * refr;
-        surfaceColor = surfaceColor * (1.0f - (refl + refr)) + result;
+    if (!output.empty() && !writeImage(output, job.width, job.height, pixels)) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return 1;
     }
 
-    return surfaceColor;
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"width\": " << job.width << ",\n"
+         << "  \"height\": " << job.height << ",\n"
+         << "  \"tiles\": " << makeTiles(job.width, job.height, kTileSize).size() << ",\n"
+         << "  \"workers\": " << stats.workers << ",\n"
+         << "  \"lostWorkers\": " << stats.lostWorkers << ",\n"
+         << "  \"reissuedTiles\": " << stats.reissuedTiles << ",\n"
+         << "  \"tilesPerWorker\": [";
+    for (size_t i = 0; i < stats.tilesPerWorker.size(); i++) json << (i ? ", " : "") << stats.tilesPerWorker[i];
+    json << "],\n"
+         << "  \"wallMs\": " << wallMs << "\n"
+         << "}\n";
+
+    if (reportPath.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(reportPath) << json.str();
+    }
+    return 0;
 }
 
-int main() {
-    int width = 800;
-    int height = 600;
-    int maxDepth = 5;
+// Исполнитель распределённого рендеринга (--worker адрес)
+int runWorker(const Scene& scene, int threads, SimdLevel simd, int argc, char** argv) {
+    std::string address = stringOption(argc, argv, "--worker", "");
+    std::string error;
+    int fd = connectSocket(address, error);
+    if (fd < 0) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    int tiles = 0;
+    bool ok = serveWorker(fd, scene, threads, simd, intOption(argc, argv, "--fail-after", 0), tiles, error);
+    ::close(fd);
+    std::cout << "Worker: " << tiles << " tiles" << std::endl;
+    if (!ok) std::cerr << error << std::endl;
+    return ok ? 0 : 1;
+}
 
-    sf::RenderWindow window(sf::VideoMode(width, height), "Ray Tracing Example with Two Lights");
-    window.setFramerateLimit(30);
+int main(int argc, char** argv) {
+    int width = std::max(1, intOption(argc, argv, "--width", 800));
+    int height = std::max(1, intOption(argc, argv, "--height", 600));
+    int maxDepth = std::min(kMaxDepth, std::max(0, intOption(argc, argv, "--depth", 5)));
+    bool headless = flagOption(argc, argv, "--headless");
 
     Sphere sphere1(Vec3(-1.5f, 0.0f, -5.0f), 1.0f, Vec3(1.0f, 0.0f, 0.0f), 0.5f, 0.0f, 1.0f);
     Sphere sphere2(Vec3(1.5f, 0.0f, -5.0f), 1.0f, Vec3(0.0f, 1.0f, 0.0f), 0.0f, 0.8f, 1.5f);
@@ -249,53 +610,206 @@ int main() {
 
     std::vector<Object*> objects = {&sphere1, &sphere2, &sphere3, &plane};
 
-    Vec3 lightPos1(-2, 5, -3);
-    Vec3 lightPos2(2, 5, -2);
-    bool light1On = true;
-    bool light2On = true;
+    std::vector<Sphere> field = makeSphereField(std::max(0, intOption(argc, argv, "--spheres", 0)),
+                                                floatOption(argc, argv, "--glossy", 0.2f));
+    for (auto& s : field) objects.push_back(&s);
 
-    std::vector<sf::Uint8> pixels(width * height * 4, 0);
+    std::vector<Light> lightList = {{Vec3(-2, 5, -3)}, {Vec3(2, 5, -2)}};
 
-    float fov = 60.0f;
-    float aspectRatio = float(width) / float(height);
-    float angle = std::tan((fov * 0.5f * M_PI / 180.0f));
+    // Сцена из файла (--scene) заменяет встроенную
+    std::string scenePath = stringOption(argc, argv, "--scene", "");
+    auto buildStart = std::chrono::steady_clock::now();
+    Scene scene;
+    if (scenePath.empty()) {
+        scene = Scene(objects);
+    } else {
+        std::string error;
+        if (!loadScene(scenePath, scene, lightList, error)) {
+            std::cerr << scenePath << ": " << error << std::endl;
+            return 1;
+        }
+    }
+    // --lights добавляет слабые источники с затуханием над полем сфер
+    std::vector<Light> extraLights = makeLightField(std::max(0, intOption(argc, argv, "--lights", 0)));
+    lightList.insert(lightList.end(), extraLights.begin(), extraLights.end());
+    LightSet lights(lightList);
+    // Сколько источников выбирается в точке, если их больше
+    lights.samples = std::max(1, intOption(argc, argv, "--light-samples", lights.samples));
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+
+    SimdLevel simd = detectSimd();
+    std::string simdRequest = stringOption(argc, argv, "--simd", "");
+    if (simdRequest == "scalar") simd = SimdLevel::Scalar;
+    else if (simdRequest == "sse" && simd == SimdLevel::AVX2) simd = SimdLevel::SSE;
+
+    int threads = std::max(1, intOption(argc, argv, "--threads", (int)std::thread::hardware_concurrency()));
+    // Вторичные лучи с весом меньше --min-weight отбрасываются (0 - без отсечения)
+    float minWeight = std::max(0.0f, floatOption(argc, argv, "--min-weight", 1e-3f));
+    bool roulette = flagOption(argc, argv, "--roulette");
+    // Выходная стадия: сжатие HDR (clamp, reinhard, aces) и множитель экспозиции
+    std::string toneMapRequest = stringOption(argc, argv, "--tonemap", "clamp");
+    ToneMap toneMap = toneMapRequest == "aces" ? ToneMap::ACES
+                    : toneMapRequest == "reinhard" ? ToneMap::Reinhard : ToneMap::Clamp;
+    float exposure = std::max(0.0f, floatOption(argc, argv, "--exposure", 1.0f));
+
+    // Распределённый рендеринг: размер кадра и источники задаёт координатор
+    if (!stringOption(argc, argv, "--worker", "").empty()) {
+        return runWorker(scene, threads, simd, argc, argv);
+    }
+    if (!stringOption(argc, argv, "--coordinator", "").empty()) {
+        RenderJob job;
+        job.width = width;
+        job.height = height;
+        job.maxDepth = maxDepth;
+        job.roulette = roulette;
+        job.minWeight = minWeight;
+        job.toneMap = (std::uint8_t)toneMap;
+        job.exposure = exposure;
+        if (lights.count() > kMaxJobLights) {
+            std::cerr << "Too many lights for distributed rendering" << std::endl;
+            return 1;
+        }
+        return runCoordinator(scene, job, lights, argc, argv);
+    }
 
-    auto renderScene = [&](bool updateTexture) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                float xx = (2 * ((x + 0.5f) / (float)width) - 1) * angle * aspectRatio;
-                float yy = (1 - 2 * ((y + 0.5f) / (float)height)) * angle;
+    // Счётчики наследуются только потоками, созданными позже, то есть пулом рендерера
+    std::unique_ptr<PerfCounters> perf(headless ? new PerfCounters() : nullptr);
+    Renderer renderer(scene, width, height, maxDepth, threads, simd);
+    renderer.lights = lights;
+    // Слои первых двух источников: переключение Q/R только пересобирает кадр
+    renderer.useLayers = flagOption(argc, argv, "--layers");
+    // Порядок тайлов: по стоимости в прошлом кадре (cost) или по порядку (static)
+    renderer.costAware = stringOption(argc, argv, "--schedule", "cost") != "static";
+    // Адаптивное сглаживание: до --aa отсчётов (4, 9, 16...) на пиксель у краёв
+    renderer.aaSamples = std::max(1, intOption(argc, argv, "--aa", 1));
+    renderer.aaThreshold = floatOption(argc, argv, "--aa-threshold", renderer.aaThreshold);
+    // Волновой трассировщик (--engine wavefront) вместо рекурсивного
+    renderer.engine = stringOption(argc, argv, "--engine", "recursive") == "wavefront" ? TraceEngine::Wavefront
+                                                                                      : TraceEngine::Recursive;
+    // Упорядочивание вторичных лучей по направлению и началу (только wavefront)
+    renderer.sortRays = flagOption(argc, argv, "--sort-rays");
+    // Обход пикселей тайла: по кривой Мортона (zorder) или построчно (rows)
+    renderer.traversal = stringOption(argc, argv, "--traversal", "zorder") == "rows" ? Traversal::Rows : Traversal::ZOrder;
+    renderer.setPruning(minWeight, roulette);
+    renderer.toneMap = toneMap;
+    renderer.exposure = exposure;
+    // Усреднение --accumulate кадров со смещёнными отсчётами; в окне кадры
+    // добавляются, пока сцена не меняется
+    renderer.accumulate = std::max(1, intOption(argc, argv, "--accumulate", 1));
+
+    if (!stringOption(argc, argv, "--sequence", "").empty()) {
+        return runSequence(renderer, scene, argc, argv);
+    }
+    if (flagOption(argc, argv, "--compare-engines")) {
+        return runEngineCompare(renderer, argc, argv);
+    }
+    if (headless) {
+        // Один кадр анимации (--animation файл --at-frame N): с ним сверяется
+        // кадр N последовательности, ведь уже в кадре 0 ключи могут сдвигать
+        // объекты относительно сцены из файла
+        std::string animPath = stringOption(argc, argv, "--animation", "");
+        if (!animPath.empty()) {
+            Animation anim;
+            std::string error;
+            if (!loadAnimation(animPath, scene, renderer.lights.count(), anim, error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            anim.apply(std::max(0, intOption(argc, argv, "--at-frame", 0)), scene, renderer.lights);
+        }
+        return runHeadless(renderer, *perf, argc, argv, buildMs, simdName(simd), maxDepth);
+    }
 
-                Vec3 rayDir(xx, yy, -1);
-                rayDir = rayDir.normalize();
+    std::cout << "Primary rays: " << simdName(simd) << std::endl;
 
-                Vec3 col = trace(Vec3(0, 0, 0), rayDir, objects, lightPos1, lightPos2, light1On, light2On, 0, maxDepth);
+    const std::string title = "Ray Tracing Example with Lights";
+    sf::RenderWindow window(sf::VideoMode(width, height), title);
+    window.setFramerateLimit(30);
 
-                // Применение гамма-коррекции
-                float gamma = 2.2f;
-                col.x = std::pow(col.x, 1.0f / gamma);
-                col.y = std::pow(col.y, 1.0f / gamma);
-                col.z = std::pow(col.z, 1.0f / gamma);
+    // Разрешение трассировки подстраивается под --frame-budget мс на кадр
+    // (0 - всегда полное), картинка растягивается до размера окна.
+    // В прогрессивном режиме окно не ждёт трассировки, и регулятор не нужен,
+    // как и при накоплении: смена разрешения сбрасывала бы накопленное.
+    bool progressiveMode = flagOption(argc, argv, "--progressive");
+    if (progressiveMode) renderer.accumulate = 1;
+    bool fixedScale = progressiveMode || renderer.accumulate > 1;
+    ResolutionGovernor governor(fixedScale ? 0.0 : floatOption(argc, argv, "--frame-budget", 1000.0f / 30),
+                                floatOption(argc, argv, "--min-scale", 0.25f));
+    sf::Texture texture;
+    sf::Sprite sprite;
+    auto applyScale = [&]() {
+        int w = std::max(1, (int)std::lround(width * governor.scale()));
+        int h = std::max(1, (int)std::lround(height * governor.scale()));
+        if (w != renderer.frameWidth() || h != renderer.frameHeight()) renderer.resize(w, h);
+        texture.create(w, h);
+        texture.setSmooth(w != width);
+        sprite.setTexture(texture, true);
+        sprite.setScale((float)width / w, (float)height / h);
+        std::ostringstream caption;
+        caption << title;
+        if (governor.enabled()) caption << " - scale " << (int)std::lround(governor.scale() * 100) << "%";
+        window.setTitle(caption.str());
+    };
+    applyScale();
+    bool scaleChanged = false;
+
+    // Каждый пиксель вычисляется независимо, поэтому результат не зависит
+    // от числа потоков и порядка обработки тайлов.
+    // lightsOnly: изменились только источники, кадр можно собрать из слоёв
+    // Q и R переключают первый и второй источники
+    std::vector<char> lightsOn(lights.count(), 1);
+    auto renderScene = [&](bool lightsOnly) {
+        // Новый масштаб применяется перед трассировкой, чтобы не стереть показанный кадр
+        if (scaleChanged) applyScale();
+        scaleChanged = false;
+        // Сборка из слоёв почти ничего не стоит, регулятору важна только трассировка
+        bool traced = !lightsOnly || !renderer.hasLayers();
+        auto start = std::chrono::steady_clock::now();
+        renderer.resetStats();
+        for (int i = 0; i < lights.count(); i++) renderer.lights.setOn(i, lightsOn[i] != 0);
+        if (lightsOnly) renderer.composite();
+        else renderer.render();
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+        std::cout << (lightsOnly ? "Composite: " : "Render: ") << elapsed.count() << " ms, "
+                  << renderer.threadCount() << " threads, "
+                  << renderer.prunedCount() << " rays pruned, "
+                  << renderer.samplesPerPixel() << " samples per pixel, "
+                  << renderer.frameWidth() << "x" << renderer.frameHeight() << std::endl;
+        if (traced && governor.update(elapsed.count())) {
+            scaleChanged = true;
+            std::cout << "Resolution scale: " << governor.scale() << std::endl;
+        }
+    };
 
-                int r = (int)(std::max(0.0f, std::min(1.0f, col.x)) * 255);
-                int g = (int)(std::max(0.0f, std::min(1.0f, col.y)) * 255);
-                int b = (int)(std::max(0.0f, std::min(1.0f, col.z)) * 255);
+    // Кадр рендерера разложен по тайлам и переводится в построчный только здесь
+    std::vector<sf::Uint8> pixels;
+    auto upload = [&]() {
+        renderer.copyPixels(pixels);
+        texture.update( & pixels[0]);
+    };
 
-                pixels[(y * width + x) * 4 + 0] = (sf::Uint8)r;
-                pixels[(y * width + x) * 4 + 1] = (sf::Uint8)g;
+    // Прогрессивный режим: кадр уточняется в фоне, окно не блокируется
+    std::unique_ptr<ProgressiveJob> progressive;
+    if (progressiveMode) {
+        progressive.reset(new ProgressiveJob(renderer));
+        progressive->restart(lightsOn, false);
+    } else {
+        renderScene(false);
+        upload();
+    }
 
-                pixels[(y * width + x) * 4 + 2] = (sf::Uint8)b;
-                pixels[(y * width + x) * 4 + 3] = 255;
-            }
+    // Перерисовка после смены состояния источников
+    auto onLightsChanged = [&]() {
+        if (progressive) {
+            progressive->restart(lightsOn, true);
+        } else {
+            if (!renderer.useLayers) renderer.resetAccumulation();
+            renderScene(renderer.useLayers);
+            upload();
         }
     };
 
-    renderScene(false);
-    sf::Texture texture;
-
-    texture.create(width, height);
-    texture.update( & pixels[0]);
-    sf::Sprite sprite(texture);
+    std::vector<sf::Uint8> frame;
 
     while(window.isOpen()) {
         sf::Event ev;
@@ -304,18 +818,21 @@ int main() {
                 window.close();
             }
             if(ev.type == sf::Event::KeyPressed) {
-                if(ev.key.code == sf::Keyboard::Q) {
-                    light1On = !light1On;
-                    renderScene(false);
-                    texture.update( & pixels[0]);
-                }
-                if(ev.key.code == sf::Keyboard::R) {
-                    light2On = !light2On;
-                    renderScene(false);
-                    texture.update( & pixels[0]);
+                int toggled = ev.key.code == sf::Keyboard::Q ? 0 : ev.key.code == sf::Keyboard::R ? 1 : -1;
+                if (toggled >= 0 && toggled < (int)lightsOn.size()) {
+                    lightsOn[toggled] = !lightsOn[toggled];
+                    onLightsChanged();
                 }
             }
         }
+        if (progressive && progressive->takeFrame(frame)) {
+            texture.update( & frame[0]);
+        }
+        // Пока сцена не меняется, кадры добавляются к накопленным
+        if (!progressive && renderer.accumulatedFrames() < renderer.accumulate) {
+            renderScene(false);
+            upload();
+        }
         window.clear(sf::Color::Black);
         window.draw(sprite);
         window.display();
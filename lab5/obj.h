@@ -0,0 +1,111 @@
+#pragma once
+
+// Чтение и запись треугольных сеток в формате Wavefront OBJ. Из файла берутся
+// только вершины (v) и грани (f); многоугольники разбиваются на треугольники
+// веером, текстурные координаты, нормали и материалы пропускаются.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "raytracer.h"
+
+// Индекс вершины из записи грани вида v, v/vt, v//vn или v/vt/vn.
+// Отрицательные индексы отсчитываются от последней прочитанной вершины.
+inline bool parseOBJIndex(char*& s, int vertexCount, int& index) {
+    char* next;
+    long i = std::strtol(s, &next, 10);
+    if (next == s) return false;
+    while (*next && *next != ' ' && *next != '\t' && *next != '\r') next++;
+    s = next;
+    index = i > 0 ? (int)i - 1 : vertexCount + (int)i;
+    return i != 0 && index >= 0 && index < vertexCount;
+}
+
+// Загружает сетку из OBJ-файла и строит её BVH
+inline bool loadOBJ(const std::string& path, Mesh& mesh, std::string& error) {
+    MappedFile file(path);
+    if (!file.ok()) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::vector<Vec3> vertices;
+    std::vector<int> face;
+    const char* p = file.data();
+    const char* end = p + file.size();
+    char line[1024];
+    int lineNumber = 0;
+
+    while (p < end) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        lineNumber++;
+        size_t length = std::min((size_t)(eol - p), sizeof(line) - 1);
+        std::memcpy(line, p, length);
+        line[length] = 0;
+        p = eol + 1;
+
+        char* s = line;
+        while (*s == ' ' || *s == '\t') s++;
+
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            s += 2;
+            float v[3];
+            for (float& c : v) {
+                char* next;
+                c = std::strtof(s, &next);
+                if (next == s) {
+                    error = path + ":" + std::to_string(lineNumber) + ": bad vertex";
+                    return false;
+                }
+                s = next;
+            }
+            vertices.push_back(Vec3(v[0], v[1], v[2]));
+        } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            s += 2;
+            face.clear();
+            int index;
+            for (;;) {
+                while (*s == ' ' || *s == '\t') s++;
+                if (!*s || *s == '\r') break;
+                if (!parseOBJIndex(s, (int)vertices.size(), index)) {
+                    error = path + ":" + std::to_string(lineNumber) + ": bad vertex index";
+                    return false;
+                }
+                face.push_back(index);
+            }
+            for (size_t k = 2; k < face.size(); k++) {
+                mesh.addTriangle(vertices[face[0]], vertices[face[k - 1]], vertices[face[k]]);
+            }
+        }
+    }
+
+    if (mesh.triangleCount() == 0) {
+        error = path + ": no triangles";
+        return false;
+    }
+    mesh.build();
+    return true;
+}
+
+// Записывает каждый треугольник сетки тремя отдельными вершинами
+inline bool saveOBJ(const std::string& path, const Mesh& mesh) {
+    std::FILE* f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+
+    for (int i = 0; i < mesh.triangleCount(); i++) {
+        for (int k = 0; k < 3; k++) {
+            Vec3 v = mesh.vertex(i, k);
+            std::fprintf(f, "v %.9g %.9g %.9g\n", v.x, v.y, v.z);
+        }
+    }
+    for (int i = 0; i < mesh.triangleCount(); i++) {
+        std::fprintf(f, "f %d %d %d\n", i * 3 + 1, i * 3 + 2, i * 3 + 3);
+    }
+    bool ok = !std::ferror(f);
+    return std::fclose(f) == 0 && ok;
+}
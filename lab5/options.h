@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Разбор параметров командной строки вида --name value и --flag
+
+inline int intOption(int argc, char** argv, const char* name, int defaultValue) {
+    int value = defaultValue;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            value = std::atoi(argv[i + 1]);
+        }
+    }
+    return value;
+}
+
+inline float floatOption(int argc, char** argv, const char* name, float defaultValue) {
+    float value = defaultValue;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            value = (float)std::atof(argv[i + 1]);
+        }
+    }
+    return value;
+}
+
+inline bool flagOption(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) return true;
+    }
+    return false;
+}
+
+inline std::string stringOption(int argc, char** argv, const char* name, const std::string& defaultValue) {
+    std::string value = defaultValue;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            value = argv[i + 1];
+        }
+    }
+    return value;
+}
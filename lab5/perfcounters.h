@@ -0,0 +1,97 @@
+#pragma once
+
+// Аппаратные счётчики кэша процессора через perf_event_open (только Linux).
+// Счётчики открываются выключенными и наследуются потоками, созданными после
+// открытия, поэтому объект нужно создать раньше пула потоков рендерера.
+// Недоступный счётчик (нет прав, виртуальная машина без PMU) просто не
+// попадает в отчёт: ok(i) для него false.
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters {
+public:
+    enum Counter { kCacheReferences, kCacheMisses, kL1dReadMisses, kCount };
+
+    static const char* name(int i) {
+        static const char* names[kCount] = {"cacheReferences", "cacheMisses", "l1dReadMisses"};
+        return names[i];
+    }
+
+    PerfCounters() {
+        for (int i = 0; i < kCount; i++) fds[i] = -1;
+#if defined(__linux__)
+        const std::uint32_t types[kCount] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+        const std::uint64_t configs[kCount] = {
+            PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+        for (int i = 0; i < kCount; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool ok(int i) const { return fds[i] >= 0; }
+
+    bool any() const {
+        for (int i = 0; i < kCount; i++) {
+            if (ok(i)) return true;
+        }
+        return false;
+    }
+
+    // Включение и выключение действуют и на унаследованные счётчики потоков
+    void start() { enable(true); }
+    void stop() { enable(false); }
+
+    // Сумма по процессу и потокам, созданным после открытия
+    std::uint64_t value(int i) const {
+        std::uint64_t v = 0;
+#if defined(__linux__)
+        if (ok(i) && read(fds[i], &v, sizeof(v)) != (ssize_t)sizeof(v)) v = 0;
+#else
+        (void)i;
+#endif
+        return v;
+    }
+
+private:
+    void enable(bool on) {
+#if defined(__linux__)
+        for (int fd : fds) {
+            if (fd >= 0) ioctl(fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+        }
+#else
+        (void)on;
+#endif
+    }
+
+    int fds[kCount];
+};
@@ -0,0 +1,1666 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define LAB5_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(LAB5_X86) && defined(__GNUC__)
+#define LAB5_AVX2 1
+#define LAB5_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Счётчики лучей и проверок пересечений для поиска узких мест. Собираются
+// только при сборке с LAB5_RAY_STATS, иначе LAB5_STAT(...) ничего не делает.
+struct RayStats {
+    std::uint64_t primary = 0;
+    std::uint64_t shadow = 0;
+    std::uint64_t reflection = 0;
+    std::uint64_t refraction = 0;
+    std::uint64_t boxTests = 0;       // параллелепипеды узлов BVH
+    std::uint64_t primitiveTests = 0; // сферы, плоскости и треугольники
+    int maxDepth = 0;                 // наибольшая глубина попадания
+
+    void merge(const RayStats& o) {
+        primary += o.primary;
+        shadow += o.shadow;
+        reflection += o.reflection;
+        refraction += o.refraction;
+        boxTests += o.boxTests;
+        primitiveTests += o.primitiveTests;
+        maxDepth = std::max(maxDepth, o.maxDepth);
+    }
+};
+
+#if defined(LAB5_RAY_STATS)
+#define LAB5_STAT(expr) ((void)(expr))
+
+// Счётчики, в которые пишет текущий поток. Renderer на время тайла
+// направляет их в TraceContext исполнителя через RayStatsScope, а
+// складываются они по исполнителям после кадра.
+inline thread_local RayStats unboundRayStats;
+inline thread_local RayStats* boundRayStats = &unboundRayStats;
+
+inline RayStats& threadRayStats() { return *boundRayStats; }
+
+struct RayStatsScope {
+    RayStats* saved;
+    explicit RayStatsScope(RayStats& stats) : saved(boundRayStats) { boundRayStats = &stats; }
+    ~RayStatsScope() { boundRayStats = saved; }
+};
+#else
+#define LAB5_STAT(expr) ((void)0)
+#endif
+
+struct Vec3 {
+    float x, y, z;
+    Vec3(float x_ = 0, float y_ = 0, float z_ = 0) : x(x_), y(y_), z(z_) {}
+
+    Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+    Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+    Vec3 operator*(float f) const { return Vec3(x * f, y * f, z * f); }
+    Vec3 operator/(float f) const { return Vec3(x / f, y / f, z / f); }
+    Vec3 operator*(const Vec3& v) const { return Vec3(x * v.x, y * v.y, z * v.z); }
+
+    float dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
+    Vec3 cross(const Vec3& v) const {
+        return Vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+    }
+
+    float length() const { return std::sqrt(dot(*this)); }
+    Vec3 normalize() const { 
+        float len = length(); 
+        return len > 0 ? (*this) * (1.0f / len) : *this; 
+    }
+};
+
+// Ограничивающий параллелепипед, выровненный по осям
+struct AABB {
+    Vec3 min = Vec3(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity());
+    Vec3 max = Vec3(-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity());
+
+    void expand(const Vec3& p) {
+        min = Vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    // Пустой b (min > max) не меняет параллелепипед
+    void expand(const AABB& b) {
+        min = Vec3(std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z));
+        max = Vec3(std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z));
+    }
+
+    Vec3 centroid() const { return (min + max) * 0.5f; }
+
+    float surfaceArea() const {
+        Vec3 e = max - min;
+        if (e.x < 0 || e.y < 0 || e.z < 0) return 0.0f;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+// Расстояние до сферы вдоль луча или бесконечность при промахе.
+// Записано без ветвлений, чтобы циклы по массивам сфер векторизовались.
+inline float sphereDistance(float cx, float cy, float cz, float radius, const Vec3& orig, const Vec3& dir) {
+    float Lx = cx - orig.x, Ly = cy - orig.y, Lz = cz - orig.z;
+    float tca = Lx * dir.x + Ly * dir.y + Lz * dir.z;
+    float d2 = (Lx * Lx + Ly * Ly + Lz * Lz) - tca * tca;
+    float r2 = radius * radius;
+    float thc = std::sqrt(std::max(r2 - d2, 0.0f));
+    float t0 = tca - thc;
+    float t1 = tca + thc;
+    float t = t0 < 0 ? t1 : t0;
+    bool hit = tca >= 0 && d2 <= r2 && t >= 0;
+    return hit ? t : std::numeric_limits<float>::infinity();
+}
+
+// Расстояние до плоскости n·p + d = 0 вдоль луча или бесконечность при промахе
+inline float planeDistance(float nx, float ny, float nz, float d, const Vec3& orig, const Vec3& dir) {
+    float denom = nx * dir.x + ny * dir.y + nz * dir.z;
+    float t = -((nx * orig.x + ny * orig.y + nz * orig.z) + d) / denom;
+    bool hit = std::fabs(denom) > 1e-6f && t >= 0;
+    return hit ? t : std::numeric_limits<float>::infinity();
+}
+
+// Расстояние до треугольника (v0, v0 + e1, v0 + e2) вдоль луча или бесконечность
+// при промахе, по алгоритму Мёллера - Трумбора. Рёбра проверяются с небольшим
+// запасом, чтобы луч не проскакивал между соседними треугольниками сетки из-за
+// округления; попадание в соседний треугольник на общем ребре даёт то же t.
+inline float triangleDistance(float v0x, float v0y, float v0z,
+                              float e1x, float e1y, float e1z,
+                              float e2x, float e2y, float e2z,
+                              const Vec3& orig, const Vec3& dir) {
+    const float kEdgeEps = 1e-6f;
+    float px = dir.y * e2z - dir.z * e2y;
+    float py = dir.z * e2x - dir.x * e2z;
+    float pz = dir.x * e2y - dir.y * e2x;
+    float det = e1x * px + e1y * py + e1z * pz;
+    float invDet = 1.0f / det;
+    float sx = orig.x - v0x, sy = orig.y - v0y, sz = orig.z - v0z;
+    float u = (sx * px + sy * py + sz * pz) * invDet;
+    float qx = sy * e1z - sz * e1y;
+    float qy = sz * e1x - sx * e1z;
+    float qz = sx * e1y - sy * e1x;
+    float v = (dir.x * qx + dir.y * qy + dir.z * qz) * invDet;
+    float t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    bool hit = det != 0.0f && u >= -kEdgeEps && v >= -kEdgeEps && u + v <= 1.0f + kEdgeEps && t > 0.0f;
+    return hit ? t : std::numeric_limits<float>::infinity();
+}
+
+// Материал поверхности; примитивы сцены ссылаются на него по индексу
+struct Material {
+    Vec3 color;
+    float reflection = 0.0f;
+    float refraction = 0.0f;
+    float ior = 1.0f;
+};
+
+struct Scene;
+
+struct Object {
+    virtual ~Object() {}
+    virtual bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const = 0;
+    // Добавляет объект и его материал в массивы сцены
+    virtual void addTo(Scene& scene) const = 0;
+
+    float reflection = 0.0f;
+    float refraction = 0.0f;
+    float ior = 1.0f; // Индекс преломления
+};
+
+struct Sphere : public Object {
+    Vec3 center;
+    float radius;
+    Vec3 color;
+
+    Sphere(const Vec3& c, float r, const Vec3& col, float refl = 0.0f, float refr = 0.0f, float ior_ = 1.0f) {
+        center = c;
+        radius = r;
+        color = col;
+        reflection = refl;
+        refraction = refr;
+        ior = ior_;
+    }
+
+    bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const override {
+        float t0 = sphereDistance(center.x, center.y, center.z, radius, orig, dir);
+        if (t0 == std::numeric_limits<float>::infinity()) return false;
+
+        tNear = t0;
+        Vec3 phit = orig + dir * tNear;
+        hitNormal = (phit - center).normalize();
+        hitColor = color;
+
+        return true;
+    }
+
+    void addTo(Scene& scene) const override;
+};
+
+struct Plane : public Object {
+    Vec3 normal;
+    float d;
+    Vec3 color;
+
+    Plane(const Vec3& n, float d_, const Vec3& col, float refl = 0.0f, float refr = 0.0f, float ior_ = 1.0f) {
+        normal = n.normalize();
+        d = d_;
+        color = col;
+        reflection = refl;
+        refraction = refr;
+        ior = ior_;
+    }
+
+    bool intersect(const Vec3& orig, const Vec3& dir, float& tNear, Vec3& hitNormal, Vec3& hitColor) const override {
+        float t = planeDistance(normal.x, normal.y, normal.z, d, orig, dir);
+        if (t == std::numeric_limits<float>::infinity()) return false;
+
+        tNear = t;
+        hitNormal = normal;
+        hitColor = color;
+        return true;
+    }
+
+    void addTo(Scene& scene) const override;
+};
+
+// Узел BVH занимает 32 байта. Узлы хранятся в порядке обхода в глубину:
+// левый потомок внутреннего узла лежит сразу за ним, правый - по индексу.
+struct BVHNode {
+    float bmin[3];
+    int rightOrFirst; // лист: первый примитив, внутренний узел: правый потомок
+    float bmax[3];
+    int count;        // число примитивов в листе, 0 для внутреннего узла
+};
+
+// Иерархия ограничивающих объёмов, построенная по эвристике площади поверхности (SAH)
+class BVH {
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> primIndices; // порядок примитивов, в котором на них ссылаются листья
+
+    // Небольшой запас, чтобы ошибки округления не отбрасывали касательные попадания
+    static constexpr float kBoxPad = 1.0000004f;
+    // Стек обхода: на нём не больше узлов, чем внутренних узлов на пути от корня
+    static const int kStackSize = 64;
+
+    bool empty() const { return nodes.empty(); }
+
+    void build(const std::vector<AABB>& boxes) {
+        nodes.clear();
+        primIndices.resize(boxes.size());
+        if (boxes.empty()) return;
+
+        centroids.resize(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++) {
+            primIndices[i] = (int)i;
+            centroids[i] = boxes[i].centroid();
+        }
+        nodes.reserve(boxes.size() * 2);
+        buildNode(boxes, 0, (int)boxes.size());
+        centroids.clear();
+        centroids.shrink_to_fit();
+    }
+
+    // Пересчитывает параллелепипеды узлов после того, как примитивы сдвинулись,
+    // сохраняя структуру дерева. primBox(i) - параллелепипед i-го примитива
+    // в порядке листьев. Потомки лежат после родителя, поэтому достаточно
+    // одного прохода с конца.
+    template <class PrimBoxFn>
+    void refit(PrimBoxFn&& primBox) {
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            BVHNode& n = nodes[i];
+            AABB box;
+            if (n.count > 0) {
+                for (int p = n.rightOrFirst; p < n.rightOrFirst + n.count; p++) box.expand(primBox(p));
+            } else {
+                const BVHNode& l = nodes[i + 1];
+                const BVHNode& r = nodes[n.rightOrFirst];
+                box.expand(Vec3(std::min(l.bmin[0], r.bmin[0]), std::min(l.bmin[1], r.bmin[1]), std::min(l.bmin[2], r.bmin[2])));
+                box.expand(Vec3(std::max(l.bmax[0], r.bmax[0]), std::max(l.bmax[1], r.bmax[1]), std::max(l.bmax[2], r.bmax[2])));
+            }
+            n.bmin[0] = box.min.x; n.bmin[1] = box.min.y; n.bmin[2] = box.min.z;
+            n.bmax[0] = box.max.x; n.bmax[1] = box.max.y; n.bmax[2] = box.max.z;
+        }
+    }
+
+    // Пересекает ли луч параллелепипед [bmin, bmax] на отрезке [0, tMax]
+    static bool hitBox(const float bmin[3], const float bmax[3], const Vec3& orig, const Vec3& invDir, float tMax, float& tEntry) {
+        float tx0 = (bmin[0] - orig.x) * invDir.x, tx1 = (bmax[0] - orig.x) * invDir.x;
+        float ty0 = (bmin[1] - orig.y) * invDir.y, ty1 = (bmax[1] - orig.y) * invDir.y;
+        float tz0 = (bmin[2] - orig.z) * invDir.z, tz1 = (bmax[2] - orig.z) * invDir.z;
+        float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+        float tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax));
+        tEntry = tmin;
+        return tmin <= tmax * kBoxPad;
+    }
+
+    // Обходит узлы, которые пересекает луч на отрезке [0, tMax], ближние первыми.
+    // leaf(begin, end, tMax) проверяет примитивы листа, может уменьшить tMax
+    // и возвращает true, если обход можно прекратить.
+    template <class LeafFn>
+    void traverse(const Vec3& orig, const Vec3& dir, float& tMax, LeafFn&& leaf) const {
+        if (nodes.empty()) return;
+
+        Vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+        int stack[kStackSize];
+        int stackSize = 0;
+        int node = 0;
+        float tEntry;
+        if (!hitNode(nodes[0], orig, invDir, tMax, tEntry)) return;
+
+        for (;;) {
+            const BVHNode& n = nodes[node];
+            if (n.count > 0) {
+                if (leaf(n.rightOrFirst, n.rightOrFirst + n.count, tMax)) return;
+            } else {
+                int left = node + 1;
+                int right = n.rightOrFirst;
+                float tLeft, tRight;
+                bool hitLeft = hitNode(nodes[left], orig, invDir, tMax, tLeft);
+                bool hitRight = hitNode(nodes[right], orig, invDir, tMax, tRight);
+                if (hitLeft && hitRight) {
+                    if (tRight < tLeft) std::swap(left, right);
+                    stack[stackSize++] = right;
+                    node = left;
+                    continue;
+                }
+                if (hitLeft) { node = left; continue; }
+                if (hitRight) { node = right; continue; }
+            }
+            if (stackSize == 0) return;
+            node = stack[--stackSize];
+        }
+    }
+
+private:
+    static const int kBins = 16;
+    static const int kMaxLeafSize = 4;
+
+    std::vector<Vec3> centroids;
+
+    static bool hitNode(const BVHNode& n, const Vec3& orig, const Vec3& invDir, float tMax, float& tEntry) {
+        LAB5_STAT(threadRayStats().boxTests++);
+        return hitBox(n.bmin, n.bmax, orig, invDir, tMax, tEntry);
+    }
+
+    static float axis(const Vec3& v, int a) { return a == 0 ? v.x : (a == 1 ? v.y : v.z); }
+
+    int buildNode(const std::vector<AABB>& boxes, int begin, int end) {
+        int index = (int)nodes.size();
+        nodes.push_back(BVHNode());
+
+        AABB box, centroidBox;
+        for (int i = begin; i < end; i++) {
+            box.expand(boxes[primIndices[i]]);
+            centroidBox.expand(centroids[primIndices[i]]);
+        }
+        BVHNode& n = nodes[index];
+        n.bmin[0] = box.min.x; n.bmin[1] = box.min.y; n.bmin[2] = box.min.z;
+        n.bmax[0] = box.max.x; n.bmax[1] = box.max.y; n.bmax[2] = box.max.z;
+
+        int count = end - begin;
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::infinity();
+
+        if (count > 1) {
+            for (int a = 0; a < 3; a++) {
+                float lo = axis(centroidBox.min, a), hi = axis(centroidBox.max, a);
+                if (hi <= lo) continue;
+
+                AABB binBox[kBins];
+                int binCount[kBins] = {0};
+                float scale = kBins / (hi - lo);
+                for (int i = begin; i < end; i++) {
+                    int b = std::min(kBins - 1, (int)((axis(centroids[primIndices[i]], a) - lo) * scale));
+                    binCount[b]++;
+                    binBox[b].expand(boxes[primIndices[i]]);
+                }
+
+                // Площади и количества слева и справа для каждой из kBins - 1 плоскостей
+                float leftArea[kBins - 1], rightArea[kBins - 1];
+                int leftCount[kBins - 1], rightCount[kBins - 1];
+                AABB acc;
+                int sum = 0;
+                for (int b = 0; b < kBins - 1; b++) {
+                    acc.expand(binBox[b]);
+                    sum += binCount[b];
+                    leftArea[b] = acc.surfaceArea();
+                    leftCount[b] = sum;
+                }
+                acc = AABB();
+                sum = 0;
+                for (int b = kBins - 1; b > 0; b--) {
+                    acc.expand(binBox[b]);
+                    sum += binCount[b];
+                    rightArea[b - 1] = acc.surfaceArea();
+                    rightCount[b - 1] = sum;
+                }
+                for (int b = 0; b < kBins - 1; b++) {
+                    if (leftCount[b] == 0 || rightCount[b] == 0) continue;
+                    float cost = leftArea[b] * leftCount[b] + rightArea[b] * rightCount[b];
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = a;
+                        bestSplit = b;
+                    }
+                }
+            }
+        }
+
+        // Стоимость обхода узла принята равной стоимости одной проверки примитива
+        float leafCost = box.surfaceArea() * count;
+        float splitCost = box.surfaceArea() + bestCost;
+        if (bestAxis < 0 || (count <= kMaxLeafSize && leafCost <= splitCost)) {
+            n.rightOrFirst = begin;
+            n.count = count;
+            return index;
+        }
+
+        float lo = axis(centroidBox.min, bestAxis), hi = axis(centroidBox.max, bestAxis);
+        float scale = kBins / (hi - lo);
+        int* mid = std::partition(&primIndices[begin], &primIndices[0] + end, [&](int prim) {
+            return std::min(kBins - 1, (int)((axis(centroids[prim], bestAxis) - lo) * scale)) <= bestSplit;
+        });
+        int split = (int)(mid - &primIndices[0]);
+
+        buildNode(boxes, begin, split);
+        int right = buildNode(boxes, split, end);
+        nodes[index].rightOrFirst = right;
+        nodes[index].count = 0;
+        return index;
+    }
+};
+
+// Треугольная сетка с собственной BVH в своей системе координат. В сцену она
+// попадает через экземпляры (Instance), которые могут ссылаться на одну сетку.
+// Треугольник хранится как вершина v0 и рёбра e1 = v1 - v0, e2 = v2 - v0 в
+// отдельных массивах, упорядоченных по листьям BVH. Вершины с обходом против
+// часовой стрелки задают лицевую сторону, нормаль направлена наружу.
+struct Mesh {
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+
+    BVH bvh;
+
+    int triangleCount() const { return (int)v0x.size(); }
+
+    void addTriangle(const Vec3& a, const Vec3& b, const Vec3& c) {
+        Vec3 e1 = b - a, e2 = c - a;
+        v0x.push_back(a.x); v0y.push_back(a.y); v0z.push_back(a.z);
+        e1x.push_back(e1.x); e1y.push_back(e1.y); e1z.push_back(e1.z);
+        e2x.push_back(e2.x); e2y.push_back(e2.y); e2z.push_back(e2.z);
+    }
+
+    Vec3 vertex(int tri, int k) const {
+        Vec3 v0(v0x[tri], v0y[tri], v0z[tri]);
+        if (k == 1) return v0 + Vec3(e1x[tri], e1y[tri], e1z[tri]);
+        if (k == 2) return v0 + Vec3(e2x[tri], e2y[tri], e2z[tri]);
+        return v0;
+    }
+
+    // Строит BVH по треугольникам и переставляет массивы в порядок листьев
+    void build() {
+        std::vector<AABB> boxes(triangleCount());
+        for (int i = 0; i < triangleCount(); i++) {
+            for (int k = 0; k < 3; k++) boxes[i].expand(vertex(i, k));
+        }
+        bvh.build(boxes);
+
+        auto reorder = [&](std::vector<float>& v) {
+            std::vector<float> copy = v;
+            for (size_t i = 0; i < v.size(); i++) v[i] = copy[bvh.primIndices[i]];
+        };
+        for (auto* v : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) reorder(*v);
+    }
+
+    float distance(int i, const Vec3& orig, const Vec3& dir) const {
+        return triangleDistance(v0x[i], v0y[i], v0z[i], e1x[i], e1y[i], e1z[i], e2x[i], e2y[i], e2z[i], orig, dir);
+    }
+
+    Vec3 normal(int tri) const {
+        return Vec3(e1x[tri], e1y[tri], e1z[tri]).cross(Vec3(e2x[tri], e2y[tri], e2z[tri])).normalize();
+    }
+
+    AABB bounds() const {
+        AABB box;
+        if (!bvh.empty()) {
+            box.expand(Vec3(bvh.nodes[0].bmin[0], bvh.nodes[0].bmin[1], bvh.nodes[0].bmin[2]));
+            box.expand(Vec3(bvh.nodes[0].bmax[0], bvh.nodes[0].bmax[1], bvh.nodes[0].bmax[2]));
+        }
+        return box;
+    }
+
+    // Ближайший треугольник ближе tMax; при попадании уменьшает tMax.
+    // dir может быть ненормированным, t измеряется в его длинах.
+    bool intersect(const Vec3& orig, const Vec3& dir, float& tMax, int& tri) const {
+        bool hit = false;
+        bvh.traverse(orig, dir, tMax, [&](int begin, int end, float& t) {
+            LAB5_STAT(threadRayStats().primitiveTests += end - begin);
+            for (int i = begin; i < end; i++) {
+                float d = distance(i, orig, dir);
+                if (d < t) {
+                    t = d;
+                    tri = i;
+                    hit = true;
+                }
+            }
+            return false;
+        });
+        return hit;
+    }
+
+    bool occluded(const Vec3& orig, const Vec3& dir, float maxDist) const {
+        bool hit = false;
+        float tMax = maxDist;
+        bvh.traverse(orig, dir, tMax, [&](int begin, int end, float&) {
+            for (int i = begin; i < end; i++) {
+                LAB5_STAT(threadRayStats().primitiveTests++);
+                if (distance(i, orig, dir) < maxDist) return hit = true;
+            }
+            return false;
+        });
+        return hit;
+    }
+};
+
+// Аффинное преобразование: матрица 3x4 по строкам, p' = M * (p, 1)
+struct Transform {
+    float m[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+
+    // Масштаб, затем повороты вокруг X, Y и Z (в градусах), затем сдвиг
+    static Transform fromTRS(const Vec3& translate, const Vec3& rotateDeg, float scale) {
+        const float k = (float)M_PI / 180.0f;
+        float cx = std::cos(rotateDeg.x * k), sx = std::sin(rotateDeg.x * k);
+        float cy = std::cos(rotateDeg.y * k), sy = std::sin(rotateDeg.y * k);
+        float cz = std::cos(rotateDeg.z * k), sz = std::sin(rotateDeg.z * k);
+        // R = Rz * Ry * Rx
+        float r[9] = {cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx,
+                      sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx,
+                      -sy, cy * sx, cy * cx};
+        Transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) t.m[i * 4 + j] = r[i * 3 + j] * scale;
+        }
+        t.m[3] = translate.x;
+        t.m[7] = translate.y;
+        t.m[11] = translate.z;
+        return t;
+    }
+
+    Vec3 point(const Vec3& p) const {
+        return Vec3(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3],
+                    m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7],
+                    m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]);
+    }
+
+    Vec3 vector(const Vec3& v) const {
+        return Vec3(m[0] * v.x + m[1] * v.y + m[2] * v.z,
+                    m[4] * v.x + m[5] * v.y + m[6] * v.z,
+                    m[8] * v.x + m[9] * v.y + m[10] * v.z);
+    }
+
+    // Умножение на транспонированную часть 3x3: для обратного преобразования
+    // переводит нормали из локальной системы координат в мировую
+    Vec3 transposedVector(const Vec3& v) const {
+        return Vec3(m[0] * v.x + m[4] * v.y + m[8] * v.z,
+                    m[1] * v.x + m[5] * v.y + m[9] * v.z,
+                    m[2] * v.x + m[6] * v.y + m[10] * v.z);
+    }
+
+    // Обратное преобразование; матрица должна быть невырожденной
+    Transform inverse() const {
+        float a = m[0], b = m[1], c = m[2], d = m[4], e = m[5], f = m[6], g = m[8], h = m[9], i = m[10];
+        float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+        float invDet = 1.0f / (a * A + b * B + c * C);
+        Transform t;
+        float r[9] = {A, c * h - b * i, b * f - c * e,
+                      B, a * i - c * g, c * d - a * f,
+                      C, b * g - a * h, a * e - b * d};
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 3; col++) t.m[row * 4 + col] = r[row * 3 + col] * invDet;
+        }
+        Vec3 o = t.vector(Vec3(m[3], m[7], m[11]));
+        t.m[3] = -o.x;
+        t.m[7] = -o.y;
+        t.m[11] = -o.z;
+        return t;
+    }
+
+    AABB apply(const AABB& box) const {
+        AABB r;
+        for (int k = 0; k < 8; k++) {
+            r.expand(point(Vec3(k & 1 ? box.max.x : box.min.x, k & 2 ? box.max.y : box.min.y, k & 4 ? box.max.z : box.min.z)));
+        }
+        return r;
+    }
+};
+
+// Экземпляр сетки: ссылка на общую геометрию, преобразование и свой материал.
+// Луч переводится в систему координат сетки без нормировки направления,
+// поэтому расстояния t в обеих системах совпадают.
+struct Instance {
+    int mesh;
+    int material;
+    Transform toWorld;
+    Transform toObject;
+};
+
+// Результат поиска ближайшего пересечения
+struct Hit {
+    float t = std::numeric_limits<float>::infinity();
+    int prim = -1; // индекс сферы, -2 - j для плоскости j, -1 - промах
+    int instance = -1; // экземпляр сетки, если попадание в треугольник; тогда prim - его индекс
+};
+
+// Сцена в виде структуры массивов: сферы и плоскости хранятся покомпонентно
+// в отдельных массивах, материалы - в общей таблице. Сферы упорядочены по
+// листьям BVH, поэтому каждый лист ссылается на непрерывный диапазон.
+// Сетки образуют двухуровневую структуру: верхняя BVH (tlas) по экземплярам
+// и собственные BVH сеток, общие для всех их экземпляров.
+struct Scene {
+    std::vector<Material> materials;
+
+    std::vector<float> sphereX, sphereY, sphereZ, sphereRadius;
+    std::vector<int> sphereMaterial;
+
+    std::vector<float> planeNX, planeNY, planeNZ, planeD;
+    std::vector<int> planeMaterial;
+
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances; // в порядке листьев tlas
+
+    BVH bvh;
+    BVH tlas;
+    std::vector<int> sphereSlots; // позиция каждой сферы после перестановки в build()
+
+    Scene() {}
+
+    // Адаптер для сцен, собранных из объектов Object
+    explicit Scene(const std::vector<Object*>& objects) {
+        for (auto obj : objects) obj->addTo(*this);
+        build();
+    }
+
+    int addMaterial(const Material& m) {
+        materials.push_back(m);
+        return (int)materials.size() - 1;
+    }
+
+    void addSphere(const Vec3& center, float radius, int material) {
+        sphereX.push_back(center.x);
+        sphereY.push_back(center.y);
+        sphereZ.push_back(center.z);
+        sphereRadius.push_back(radius);
+        sphereMaterial.push_back(material);
+    }
+
+    void addPlane(const Vec3& normal, float d, int material) {
+        planeNX.push_back(normal.x);
+        planeNY.push_back(normal.y);
+        planeNZ.push_back(normal.z);
+        planeD.push_back(d);
+        planeMaterial.push_back(material);
+    }
+
+    void addInstance(int mesh, int material, const Transform& toWorld) {
+        instances.push_back({mesh, material, toWorld, toWorld.inverse()});
+    }
+
+    int sphereCount() const { return (int)sphereX.size(); }
+    int planeCount() const { return (int)planeD.size(); }
+
+    // Параллелепипед сфер и экземпляров; плоскости бесконечны и в него не входят
+    AABB bounds() const {
+        AABB box;
+        for (const BVH* b : {&bvh, &tlas}) {
+            if (b->empty()) continue;
+            box.expand(Vec3(b->nodes[0].bmin[0], b->nodes[0].bmin[1], b->nodes[0].bmin[2]));
+            box.expand(Vec3(b->nodes[0].bmax[0], b->nodes[0].bmax[1], b->nodes[0].bmax[2]));
+        }
+        return box;
+    }
+
+    // Строит BVH по сферам и переставляет массивы сфер в порядок листьев
+    void build() {
+        std::vector<AABB> boxes(sphereCount());
+        for (int i = 0; i < sphereCount(); i++) boxes[i] = sphereBox(i);
+        bvh.build(boxes);
+
+        sphereSlots.resize(sphereCount());
+        for (int i = 0; i < sphereCount(); i++) sphereSlots[bvh.primIndices[i]] = i;
+
+        auto reorder = [&](auto& v) {
+            auto copy = v;
+            for (size_t i = 0; i < v.size(); i++) v[i] = copy[bvh.primIndices[i]];
+        };
+        reorder(sphereX);
+        reorder(sphereY);
+        reorder(sphereZ);
+        reorder(sphereRadius);
+        reorder(sphereMaterial);
+
+        buildInstances();
+    }
+
+    // Строит верхнюю BVH по мировым параллелепипедам экземпляров и
+    // переставляет экземпляры в порядок её листьев. BVH сеток должны быть готовы.
+    void buildInstances() {
+        std::vector<AABB> boxes(instances.size());
+        for (size_t i = 0; i < instances.size(); i++) {
+            boxes[i] = instances[i].toWorld.apply(meshes[instances[i].mesh].bounds());
+        }
+        tlas.build(boxes);
+
+        std::vector<Instance> copy = instances;
+        for (size_t i = 0; i < instances.size(); i++) instances[i] = copy[tlas.primIndices[i]];
+    }
+
+    // Подгоняет BVH сфер под их новые положения
+    void refit() {
+        bvh.refit([&](int i) { return sphereBox(i); });
+    }
+
+    // Где лежит сфера, добавленная index-й по счёту. Пустой sphereSlots - у
+    // сцен из двоичных файлов до версии 5: их исходный порядок и есть порядок листьев.
+    int sphereSlot(int index) const { return sphereSlots.empty() ? index : sphereSlots[index]; }
+
+    Vec3 sphereCenter(int i) const { return Vec3(sphereX[i], sphereY[i], sphereZ[i]); }
+
+    AABB sphereBox(int i) const {
+        Vec3 r(sphereRadius[i], sphereRadius[i], sphereRadius[i]);
+        AABB box;
+        box.min = sphereCenter(i) - r;
+        box.max = sphereCenter(i) + r;
+        return box;
+    }
+
+    const Material& material(const Hit& hit) const {
+        if (hit.instance >= 0) return materials[instances[hit.instance].material];
+        return materials[hit.prim >= 0 ? sphereMaterial[hit.prim] : planeMaterial[-2 - hit.prim]];
+    }
+
+    Vec3 normal(const Hit& hit, const Vec3& phit) const {
+        if (hit.instance >= 0) {
+            const Instance& inst = instances[hit.instance];
+            return inst.toObject.transposedVector(meshes[inst.mesh].normal(hit.prim)).normalize();
+        }
+        if (hit.prim >= 0) return (phit - sphereCenter(hit.prim)).normalize();
+        int j = -2 - hit.prim;
+        return Vec3(planeNX[j], planeNY[j], planeNZ[j]);
+    }
+
+    // Ближайшее пересечение луча со сценой
+    bool intersect(const Vec3& orig, const Vec3& dir, Hit& hit) const {
+        LAB5_STAT(threadRayStats().primitiveTests += planeCount());
+        for (int j = 0; j < planeCount(); j++) {
+            float t = planeDistance(planeNX[j], planeNY[j], planeNZ[j], planeD[j], orig, dir);
+            if (t < hit.t) {
+                hit.t = t;
+                hit.prim = -2 - j;
+            }
+        }
+        bvh.traverse(orig, dir, hit.t, [&](int begin, int end, float& tMax) {
+            LAB5_STAT(threadRayStats().primitiveTests += end - begin);
+            for (int i = begin; i < end; i++) {
+                float t = sphereDistance(sphereX[i], sphereY[i], sphereZ[i], sphereRadius[i], orig, dir);
+                if (t < tMax) {
+                    tMax = t;
+                    hit.prim = i;
+                }
+            }
+            return false;
+        });
+        intersectInstances(orig, dir, hit);
+        return hit.prim != -1;
+    }
+
+    // Ближайшее пересечение с экземплярами сеток, если оно ближе hit.t
+    void intersectInstances(const Vec3& orig, const Vec3& dir, Hit& hit) const {
+        tlas.traverse(orig, dir, hit.t, [&](int begin, int end, float& tMax) {
+            for (int i = begin; i < end; i++) {
+                const Instance& inst = instances[i];
+                int tri;
+                if (meshes[inst.mesh].intersect(inst.toObject.point(orig), inst.toObject.vector(dir), tMax, tri)) {
+                    hit.prim = tri;
+                    hit.instance = i;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Заслоняет ли примитив prim (в кодировке Hit::prim) отрезок луча [0, maxDist).
+    // Для сферы сначала проверяется её параллелепипед, как при обходе BVH, чтобы
+    // ответ не зависел от того, найден примитив через кэш или через дерево.
+    bool occludes(int prim, const Vec3& orig, const Vec3& dir, float maxDist) const {
+        LAB5_STAT(threadRayStats().primitiveTests++);
+        if (prim >= 0 && prim < sphereCount()) {
+            float r = sphereRadius[prim];
+            float bmin[3] = {sphereX[prim] - r, sphereY[prim] - r, sphereZ[prim] - r};
+            float bmax[3] = {sphereX[prim] + r, sphereY[prim] + r, sphereZ[prim] + r};
+            Vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+            float tEntry;
+            return BVH::hitBox(bmin, bmax, orig, invDir, maxDist, tEntry) &&
+                   sphereDistance(sphereX[prim], sphereY[prim], sphereZ[prim], r, orig, dir) < maxDist;
+        }
+        int j = -2 - prim;
+        if (j >= 0 && j < planeCount()) {
+            return planeDistance(planeNX[j], planeNY[j], planeNZ[j], planeD[j], orig, dir) < maxDist;
+        }
+        return false;
+    }
+
+    // Есть ли пересечение на отрезке луча [0, maxDist). Останавливается на первом
+    // найденном примитиве, не вычисляя нормали и материалы. lastOccluder -
+    // примитив, заслонивший предыдущий такой запрос: он проверяется первым
+    // и обновляется при нахождении нового заслоняющего примитива.
+    bool occluded(const Vec3& orig, const Vec3& dir, float maxDist, int& lastOccluder) const {
+        if (lastOccluder != -1 && occludes(lastOccluder, orig, dir, maxDist)) return true;
+
+        for (int j = 0; j < planeCount(); j++) {
+            LAB5_STAT(threadRayStats().primitiveTests++);
+            if (planeDistance(planeNX[j], planeNY[j], planeNZ[j], planeD[j], orig, dir) < maxDist) {
+                lastOccluder = -2 - j;
+                return true;
+            }
+        }
+        bool hit = false;
+        float tMax = maxDist;
+        bvh.traverse(orig, dir, tMax, [&](int begin, int end, float&) {
+            for (int i = begin; i < end; i++) {
+                LAB5_STAT(threadRayStats().primitiveTests++);
+                if (sphereDistance(sphereX[i], sphereY[i], sphereZ[i], sphereRadius[i], orig, dir) < maxDist) {
+                    lastOccluder = i;
+                    return hit = true;
+                }
+            }
+            return false;
+        });
+        if (hit) return true;
+        // Треугольники в кэш заслоняющих объектов не попадают
+        tMax = maxDist;
+        tlas.traverse(orig, dir, tMax, [&](int begin, int end, float&) {
+            for (int i = begin; i < end; i++) {
+                const Instance& inst = instances[i];
+                if (meshes[inst.mesh].occluded(inst.toObject.point(orig), inst.toObject.vector(dir), maxDist)) return hit = true;
+            }
+            return false;
+        });
+        return hit;
+    }
+};
+
+inline void Sphere::addTo(Scene& scene) const {
+    scene.addSphere(center, radius, scene.addMaterial({color, reflection, refraction, ior}));
+}
+
+inline void Plane::addTo(Scene& scene) const {
+    scene.addPlane(normal, d, scene.addMaterial({color, reflection, refraction, ior}));
+}
+
+enum class SimdLevel { Scalar, SSE, AVX2 };
+
+inline const char* simdName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE: return "sse";
+        default: return "scalar";
+    }
+}
+
+inline SimdLevel detectSimd() {
+#if defined(LAB5_AVX2)
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+#if defined(LAB5_X86)
+    return SimdLevel::SSE;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+inline int packetWidth(SimdLevel level) {
+    return level == SimdLevel::AVX2 ? 8 : (level == SimdLevel::SSE ? 4 : 1);
+}
+
+// Пакет когерентных первичных лучей с общим началом
+struct RayPacket {
+    static const int kMaxWidth = 8;
+
+    Vec3 orig;
+    alignas(32) float dx[kMaxWidth];
+    alignas(32) float dy[kMaxWidth];
+    alignas(32) float dz[kMaxWidth];
+    alignas(32) float t[kMaxWidth];
+    alignas(32) int hit[kMaxWidth];  // как Hit::prim
+    alignas(32) int instance[kMaxWidth]; // как Hit::instance
+};
+
+// Пакетные ядра повторяют скалярные вычисления операция в операцию,
+// поэтому находят те же пересечения с теми же расстояниями.
+#if defined(LAB5_X86)
+inline void intersectPacketSSE(const Scene& scene, RayPacket& p) {
+    const Vec3& o = p.orig;
+    __m128 dx = _mm_load_ps(p.dx), dy = _mm_load_ps(p.dy), dz = _mm_load_ps(p.dz);
+    __m128 tNear = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128i hit = _mm_set1_epi32(-1);
+    __m128 zero = _mm_setzero_ps();
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    LAB5_STAT(threadRayStats().primitiveTests += 4 * scene.planeCount());
+    for (int j = 0; j < scene.planeCount(); j++) {
+        const float pl[4] = {scene.planeNX[j], scene.planeNY[j], scene.planeNZ[j], scene.planeD[j]};
+        __m128 denom = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[0]), dx), _mm_mul_ps(_mm_set1_ps(pl[1]), dy)),
+                                  _mm_mul_ps(_mm_set1_ps(pl[2]), dz));
+        float num = -((pl[0] * o.x + pl[1] * o.y + pl[2] * o.z) + pl[3]);
+        __m128 t = _mm_div_ps(_mm_set1_ps(num), denom);
+        __m128 m = _mm_and_ps(_mm_cmpgt_ps(_mm_and_ps(denom, absMask), _mm_set1_ps(1e-6f)),
+                              _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, tNear)));
+        tNear = _mm_or_ps(_mm_and_ps(m, t), _mm_andnot_ps(m, tNear));
+        hit = _mm_or_si128(_mm_and_si128(_mm_castps_si128(m), _mm_set1_epi32(-2 - j)),
+                           _mm_andnot_si128(_mm_castps_si128(m), hit));
+    }
+
+    if (!scene.bvh.empty()) {
+        __m128 invX = _mm_div_ps(_mm_set1_ps(1.0f), dx);
+        __m128 invY = _mm_div_ps(_mm_set1_ps(1.0f), dy);
+        __m128 invZ = _mm_div_ps(_mm_set1_ps(1.0f), dz);
+        __m128 pad = _mm_set1_ps(BVH::kBoxPad);
+
+        auto hitNode = [&](const BVHNode& n, float& tEntry) {
+            LAB5_STAT(threadRayStats().boxTests += 4);
+            __m128 tx0 = _mm_mul_ps(_mm_set1_ps(n.bmin[0] - o.x), invX), tx1 = _mm_mul_ps(_mm_set1_ps(n.bmax[0] - o.x), invX);
+            __m128 ty0 = _mm_mul_ps(_mm_set1_ps(n.bmin[1] - o.y), invY), ty1 = _mm_mul_ps(_mm_set1_ps(n.bmax[1] - o.y), invY);
+            __m128 tz0 = _mm_mul_ps(_mm_set1_ps(n.bmin[2] - o.z), invZ), tz1 = _mm_mul_ps(_mm_set1_ps(n.bmax[2] - o.z), invZ);
+            __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+            __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), tNear));
+            __m128 m = _mm_cmple_ps(tmin, _mm_mul_ps(tmax, pad));
+            if (_mm_movemask_ps(m) == 0) return false;
+            alignas(16) float e[4];
+            _mm_store_ps(e, _mm_or_ps(_mm_and_ps(m, tmin), _mm_andnot_ps(m, _mm_set1_ps(std::numeric_limits<float>::infinity()))));
+            tEntry = std::min(std::min(e[0], e[1]), std::min(e[2], e[3]));
+            return true;
+        };
+
+        int stack[BVH::kStackSize];
+        int stackSize = 0;
+        int node = 0;
+        float tEntry;
+        bool visit = hitNode(scene.bvh.nodes[0], tEntry);
+        while (visit) {
+            const BVHNode& n = scene.bvh.nodes[node];
+            if (n.count > 0) {
+                LAB5_STAT(threadRayStats().primitiveTests += 4 * n.count);
+                for (int i = n.rightOrFirst; i < n.rightOrFirst + n.count; i++) {
+                    Vec3 L = scene.sphereCenter(i) - o;
+                    __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(L.x), dx), _mm_mul_ps(_mm_set1_ps(L.y), dy)),
+                                            _mm_mul_ps(_mm_set1_ps(L.z), dz));
+                    __m128 d2 = _mm_sub_ps(_mm_set1_ps(L.dot(L)), _mm_mul_ps(tca, tca));
+                    __m128 r2 = _mm_set1_ps(scene.sphereRadius[i] * scene.sphereRadius[i]);
+                    __m128 m = _mm_and_ps(_mm_cmpge_ps(tca, zero), _mm_cmple_ps(d2, r2));
+                    if (_mm_movemask_ps(m) == 0) continue;
+                    __m128 thc = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(r2, d2), zero));
+                    __m128 t0 = _mm_sub_ps(tca, thc);
+                    __m128 t1 = _mm_add_ps(tca, thc);
+                    __m128 back = _mm_cmplt_ps(t0, zero);
+                    t0 = _mm_or_ps(_mm_and_ps(back, t1), _mm_andnot_ps(back, t0));
+                    m = _mm_and_ps(m, _mm_and_ps(_mm_cmpge_ps(t0, zero), _mm_cmplt_ps(t0, tNear)));
+                    tNear = _mm_or_ps(_mm_and_ps(m, t0), _mm_andnot_ps(m, tNear));
+                    hit = _mm_or_si128(_mm_and_si128(_mm_castps_si128(m), _mm_set1_epi32(i)),
+                                       _mm_andnot_si128(_mm_castps_si128(m), hit));
+                }
+            } else {
+                int left = node + 1;
+                int right = n.rightOrFirst;
+                float tLeft, tRight;
+                bool hitLeft = hitNode(scene.bvh.nodes[left], tLeft);
+                bool hitRight = hitNode(scene.bvh.nodes[right], tRight);
+                if (hitLeft && hitRight) {
+                    if (tRight < tLeft) std::swap(left, right);
+                    stack[stackSize++] = right;
+                    node = left;
+                    continue;
+                }
+                if (hitLeft) { node = left; continue; }
+                if (hitRight) { node = right; continue; }
+            }
+            if (stackSize == 0) break;
+            node = stack[--stackSize];
+        }
+    }
+
+    _mm_store_ps(p.t, tNear);
+    _mm_store_si128((__m128i*)p.hit, hit);
+}
+#endif
+
+#if defined(LAB5_AVX2)
+LAB5_TARGET_AVX2
+inline void intersectPacketAVX2(const Scene& scene, RayPacket& p) {
+    const Vec3& o = p.orig;
+    __m256 dx = _mm256_load_ps(p.dx), dy = _mm256_load_ps(p.dy), dz = _mm256_load_ps(p.dz);
+    __m256 tNear = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256i hit = _mm256_set1_epi32(-1);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+    LAB5_STAT(threadRayStats().primitiveTests += 8 * scene.planeCount());
+    for (int j = 0; j < scene.planeCount(); j++) {
+        const float pl[4] = {scene.planeNX[j], scene.planeNY[j], scene.planeNZ[j], scene.planeD[j]};
+        __m256 denom = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pl[0]), dx), _mm256_mul_ps(_mm256_set1_ps(pl[1]), dy)),
+                                     _mm256_mul_ps(_mm256_set1_ps(pl[2]), dz));
+        float num = -((pl[0] * o.x + pl[1] * o.y + pl[2] * o.z) + pl[3]);
+        __m256 t = _mm256_div_ps(_mm256_set1_ps(num), denom);
+        __m256 m = _mm256_and_ps(_mm256_cmp_ps(_mm256_and_ps(denom, absMask), _mm256_set1_ps(1e-6f), _CMP_GT_OQ),
+                                 _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, tNear, _CMP_LT_OQ)));
+        tNear = _mm256_blendv_ps(tNear, t, m);
+        hit = _mm256_blendv_epi8(hit, _mm256_set1_epi32(-2 - j), _mm256_castps_si256(m));
+    }
+
+    if (!scene.bvh.empty()) {
+        __m256 invX = _mm256_div_ps(_mm256_set1_ps(1.0f), dx);
+        __m256 invY = _mm256_div_ps(_mm256_set1_ps(1.0f), dy);
+        __m256 invZ = _mm256_div_ps(_mm256_set1_ps(1.0f), dz);
+        __m256 pad = _mm256_set1_ps(BVH::kBoxPad);
+        __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+        auto hitNode = [&](const BVHNode& n, float& tEntry) LAB5_TARGET_AVX2 {
+            LAB5_STAT(threadRayStats().boxTests += 8);
+            __m256 tx0 = _mm256_mul_ps(_mm256_set1_ps(n.bmin[0] - o.x), invX), tx1 = _mm256_mul_ps(_mm256_set1_ps(n.bmax[0] - o.x), invX);
+            __m256 ty0 = _mm256_mul_ps(_mm256_set1_ps(n.bmin[1] - o.y), invY), ty1 = _mm256_mul_ps(_mm256_set1_ps(n.bmax[1] - o.y), invY);
+            __m256 tz0 = _mm256_mul_ps(_mm256_set1_ps(n.bmin[2] - o.z), invZ), tz1 = _mm256_mul_ps(_mm256_set1_ps(n.bmax[2] - o.z), invZ);
+            __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_max_ps(_mm256_min_ps(tz0, tz1), zero));
+            __m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_min_ps(_mm256_max_ps(tz0, tz1), tNear));
+            __m256 m = _mm256_cmp_ps(tmin, _mm256_mul_ps(tmax, pad), _CMP_LE_OQ);
+            if (_mm256_movemask_ps(m) == 0) return false;
+            __m256 e = _mm256_blendv_ps(inf, tmin, m);
+            __m128 e4 = _mm_min_ps(_mm256_castps256_ps128(e), _mm256_extractf128_ps(e, 1));
+            e4 = _mm_min_ps(e4, _mm_movehl_ps(e4, e4));
+            e4 = _mm_min_ss(e4, _mm_shuffle_ps(e4, e4, 1));
+            tEntry = _mm_cvtss_f32(e4);
+            return true;
+        };
+
+        int stack[BVH::kStackSize];
+        int stackSize = 0;
+        int node = 0;
+        float tEntry;
+        bool visit = hitNode(scene.bvh.nodes[0], tEntry);
+        while (visit) {
+            const BVHNode& n = scene.bvh.nodes[node];
+            if (n.count > 0) {
+                LAB5_STAT(threadRayStats().primitiveTests += 8 * n.count);
+                for (int i = n.rightOrFirst; i < n.rightOrFirst + n.count; i++) {
+                    Vec3 L = scene.sphereCenter(i) - o;
+                    __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(L.x), dx), _mm256_mul_ps(_mm256_set1_ps(L.y), dy)),
+                                               _mm256_mul_ps(_mm256_set1_ps(L.z), dz));
+                    __m256 d2 = _mm256_sub_ps(_mm256_set1_ps(L.dot(L)), _mm256_mul_ps(tca, tca));
+                    __m256 r2 = _mm256_set1_ps(scene.sphereRadius[i] * scene.sphereRadius[i]);
+                    __m256 m = _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_GE_OQ), _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+                    if (_mm256_movemask_ps(m) == 0) continue;
+                    __m256 thc = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(r2, d2), zero));
+                    __m256 t0 = _mm256_sub_ps(tca, thc);
+                    __m256 t1 = _mm256_add_ps(tca, thc);
+                    t0 = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+                    m = _mm256_and_ps(m, _mm256_and_ps(_mm256_cmp_ps(t0, zero, _CMP_GE_OQ), _mm256_cmp_ps(t0, tNear, _CMP_LT_OQ)));
+                    tNear = _mm256_blendv_ps(tNear, t0, m);
+                    hit = _mm256_blendv_epi8(hit, _mm256_set1_epi32(i), _mm256_castps_si256(m));
+                }
+            } else {
+                int left = node + 1;
+                int right = n.rightOrFirst;
+                float tLeft, tRight;
+                bool hitLeft = hitNode(scene.bvh.nodes[left], tLeft);
+                bool hitRight = hitNode(scene.bvh.nodes[right], tRight);
+                if (hitLeft && hitRight) {
+                    if (tRight < tLeft) std::swap(left, right);
+                    stack[stackSize++] = right;
+                    node = left;
+                    continue;
+                }
+                if (hitLeft) { node = left; continue; }
+                if (hitRight) { node = right; continue; }
+            }
+            if (stackSize == 0) break;
+            node = stack[--stackSize];
+        }
+    }
+
+    _mm256_store_ps(p.t, tNear);
+    _mm256_store_si256((__m256i*)p.hit, hit);
+}
+#endif
+
+// Пересекает пакет из packetWidth(level) лучей со сценой
+inline void intersectPacket(const Scene& scene, SimdLevel level, RayPacket& p) {
+#if defined(LAB5_AVX2)
+    if (level == SimdLevel::AVX2) intersectPacketAVX2(scene, p);
+#endif
+#if defined(LAB5_X86)
+    if (level == SimdLevel::SSE) intersectPacketSSE(scene, p);
+#endif
+
+    // Экземпляры сеток обходятся по одному лучу
+    int width = packetWidth(level);
+    for (int k = 0; k < width; k++) {
+        Hit hit;
+        hit.t = p.t[k];
+        hit.prim = p.hit[k];
+        scene.intersectInstances(p.orig, Vec3(p.dx[k], p.dy[k], p.dz[k]), hit);
+        p.t[k] = hit.t;
+        p.hit[k] = hit.prim;
+        p.instance[k] = hit.instance;
+    }
+}
+
+inline bool refract(const Vec3& I, const Vec3& N, float ior, Vec3& refrDir) {
+    float cosi = std::clamp(I.dot(N), -1.0f, 1.0f);
+    float etai = 1.0f, etat = ior;
+    Vec3 n = N;
+
+    if (cosi < 0) {
+        cosi = -cosi;
+    } else {
+        std::swap(etai, etat);
+        n = n * -1.0f;
+    }
+
+    float eta = etai / etat;
+    float k = 1 - eta * eta * (1 - cosi * cosi);
+
+    if (k < 0) {
+        return false;
+    } else {
+        refrDir = I * eta + n * (eta * cosi - std::sqrt(k));
+        return true;
+    }
+}
+
+inline float fresnel(const Vec3& I, const Vec3& N, float ior) {
+    float cosi = std::clamp(I.dot(N), -1.0f, 1.0f);
+    float etai = 1, etat = ior;
+
+    if (cosi > 0) std::swap(etai, etat);
+
+    float sint = etai / etat * std::sqrt(std::max(0.f, 1 - cosi * cosi));
+    if (sint >= 1) {
+        return 1.0f;
+    } else {
+        float cost = std::sqrt(std::max(0.f, 1 - sint * sint));
+        cosi = std::fabs(cosi);
+
+        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+        return (Rs * Rs + Rp * Rp) * 0.5f;
+    }
+}
+
+// Точечный источник света. intensity умножает вклад источника, range задаёт
+// затухание 1 / (1 + (d / range)^2); range <= 0 - без затухания, как у
+// источников исходной сцены.
+struct Light {
+    Vec3 pos;
+    float intensity = 1.0f;
+    float range = 0.0f;
+
+    // Множитель вклада на квадрате расстояния dist2
+    float attenuation(float dist2) const {
+        return range > 0.0f ? 1.0f / (1.0f + dist2 / (range * range)) : 1.0f;
+    }
+};
+
+// Источники света сцены и BVH по ним. Если источников не больше samples,
+// в каждой точке учитываются все. Иначе выбирается samples источников: спуск
+// по дереву идёт в потомка с вероятностью, пропорциональной оценке его вклада
+// (суммарная мощность с затуханием до центра узла, но не ближе его радиуса:
+// по ближайшей точке крупные соседние узлы переоцениваются, и выборки чаще
+// уходят к далёким источникам с длинными теневыми лучами), а вклад источника
+// делится на вероятность выбора, так что среднее не смещено. Стоимость точки
+// тогда зависит от samples и глубины дерева, а не от числа источников.
+class LightSet {
+public:
+    int samples = 8;
+
+    LightSet() {}
+    explicit LightSet(const std::vector<Light>& lights_) : lights(lights_), on(lights_.size(), 1) { build(); }
+
+    int count() const { return (int)lights.size(); }
+    const Light& operator[](int i) const { return lights[i]; }
+    const std::vector<Light>& all() const { return lights; }
+
+    bool isOn(int i) const { return on[i] != 0; }
+    void setOn(int i, bool value) { on[i] = value; }
+
+    // Сдвигает источник; после сдвигов нужен refit()
+    void move(int i, const Vec3& pos) { lights[i].pos = pos; }
+
+    // Учитываются ли в каждой точке все источники
+    bool exact() const { return count() <= samples; }
+
+    void build() {
+        std::vector<AABB> boxes(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) boxes[i].expand(lights[i].pos);
+        tree.build(boxes);
+        refit();
+    }
+
+    // Подгоняет дерево под новые положения и пересчитывает мощность, центр,
+    // радиус и наибольший радиус затухания узлов (0 в invRange2 - есть источник без затухания)
+    void refit() {
+        tree.refit([&](int p) {
+            AABB box;
+            box.expand(lights[tree.primIndices[p]].pos);
+            return box;
+        });
+        nodes.resize(tree.nodes.size());
+        std::vector<float> nodeRange(tree.nodes.size());
+        for (int i = (int)tree.nodes.size() - 1; i >= 0; i--) {
+            const BVHNode& n = tree.nodes[i];
+            float power = 0.0f, range = 0.0f;
+            if (n.count > 0) {
+                for (int p = n.rightOrFirst; p < n.rightOrFirst + n.count; p++) {
+                    const Light& l = lights[tree.primIndices[p]];
+                    power += l.intensity;
+                    range = std::max(range, l.range > 0.0f ? l.range : std::numeric_limits<float>::infinity());
+                }
+            } else {
+                power = nodes[i + 1].power + nodes[n.rightOrFirst].power;
+                range = std::max(nodeRange[i + 1], nodeRange[n.rightOrFirst]);
+            }
+            LightNode& node = nodes[i];
+            node.center = Vec3(n.bmin[0] + n.bmax[0], n.bmin[1] + n.bmax[1], n.bmin[2] + n.bmax[2]) * 0.5f;
+            Vec3 half = Vec3(n.bmax[0] - n.bmin[0], n.bmax[1] - n.bmin[1], n.bmax[2] - n.bmin[2]) * 0.5f;
+            node.radius2 = half.dot(half);
+            node.power = power;
+            node.invRange2 = std::isinf(range) ? 0.0f : 1.0f / (range * range);
+            node.rightOrFirst = n.rightOrFirst;
+            node.count = n.count;
+            nodeRange[i] = range;
+        }
+    }
+
+    // Выбирает источник для точки p по числу u из [0, 1) и возвращает его
+    // индекс и вероятность выбора pdf; -1, если источников нет
+    int sample(const Vec3& p, float u, float& pdf) const {
+        pdf = 1.0f;
+        if (tree.empty()) return -1;
+        int node = 0;
+        for (;;) {
+            const LightNode& n = nodes[node];
+            if (n.count > 0) {
+                float total = 0.0f;
+                for (int k = 0; k < n.count; k++) total += lightImportance(tree.primIndices[n.rightOrFirst + k], p);
+                if (total <= 0.0f) {
+                    pdf /= n.count;
+                    return tree.primIndices[n.rightOrFirst + std::min(n.count - 1, (int)(u * n.count))];
+                }
+                float target = u * total;
+                for (int k = 0;; k++) {
+                    int light = tree.primIndices[n.rightOrFirst + k];
+                    float w = lightImportance(light, p);
+                    if (target < w || k == n.count - 1) {
+                        pdf *= w / total;
+                        return light;
+                    }
+                    target -= w;
+                }
+            }
+            int left = node + 1, right = n.rightOrFirst;
+            float il = nodeImportance(left, p), ir = nodeImportance(right, p);
+            float pl = il + ir > 0.0f ? il / (il + ir) : 0.5f;
+            if (u < pl) {
+                u /= pl;
+                pdf *= pl;
+                node = left;
+            } else {
+                u = (u - pl) / (1.0f - pl);
+                pdf *= 1.0f - pl;
+                node = right;
+            }
+            u = std::min(u, 0.99999994f);
+        }
+    }
+
+private:
+    struct LightNode {
+        Vec3 center;
+        float radius2;
+        float power;
+        float invRange2;
+        int rightOrFirst, count; // как в BVHNode
+    };
+
+    float lightImportance(int i, const Vec3& p) const {
+        Vec3 d = lights[i].pos - p;
+        return lights[i].intensity * lights[i].attenuation(d.dot(d));
+    }
+
+    float nodeImportance(int node, const Vec3& p) const {
+        const LightNode& n = nodes[node];
+        Vec3 d = n.center - p;
+        float dist2 = std::max(d.dot(d), n.radius2);
+        return n.power / (1.0f + dist2 * n.invRange2);
+    }
+
+    std::vector<Light> lights;
+    std::vector<char> on;
+    BVH tree;
+    std::vector<LightNode> nodes;
+};
+
+// Состояние, которое каждый поток рендеринга хранит между лучами
+struct TraceContext {
+    // Последний заслонивший источник примитив для каждого источника света
+    std::vector<int> lastOccluder;
+
+    // Место под count источников. Вызывается до трассировки, чтобы сами
+    // лучи не выделяли память: поток, не затенявший ничего в первом кадре,
+    // иначе дорастил бы кэш в одном из следующих.
+    void reserveLights(int count) {
+        if (count > (int)lastOccluder.size()) lastOccluder.resize(count, -1);
+    }
+
+    int& occluderCache(int light) { return lastOccluder[light]; }
+
+    // Число выпущенных лучей: первичных, теневых и вторичных
+    std::uint64_t rays = 0;
+
+    // Вторичные лучи с весом в цвете пикселя меньше minWeight не трассируются,
+    // а с roulette - трассируются с вероятностью, пропорциональной весу
+    float minWeight = 1e-3f;
+    bool roulette = false;
+    // Число отброшенных вторичных лучей
+    std::uint64_t pruned = 0;
+
+    // Подробные счётчики, только с LAB5_RAY_STATS
+    RayStats stats;
+};
+
+// Заслонён ли источник света в lightPos от точки phit. Учитываются только
+// объекты между точкой и источником.
+inline bool inShadow(const Vec3& phit, const Vec3& nhit, const Vec3& lightPos, const Scene& scene, int& lastOccluder) {
+    Vec3 toLight = lightPos - phit;
+    Vec3 lightDir = toLight.normalize();
+    return scene.occluded(phit + nhit * 1e-4f, lightDir, toLight.length(), lastOccluder);
+}
+
+const Vec3 kSkyColor(0.2f, 0.7f, 1.0f);
+
+// Цвет, разложенный по источникам света: base - вклад, не зависящий от
+// переключаемых источников (небо и источники с номерами от kLights),
+// light[i] - вклад источника i, если он включён. Итоговый цвет линейно
+// зависит от слоёв, поэтому переключение источника сводится к их повторному
+// сложению.
+struct LightLayers {
+    static const int kLights = 2;
+
+    Vec3 base;
+    Vec3 light[kLights];
+
+    LightLayers operator+(const LightLayers& o) const {
+        LightLayers r;
+        r.base = base + o.base;
+        for (int i = 0; i < kLights; i++) r.light[i] = light[i] + o.light[i];
+        return r;
+    }
+    LightLayers operator*(float f) const {
+        LightLayers r;
+        r.base = base * f;
+        for (int i = 0; i < kLights; i++) r.light[i] = light[i] * f;
+        return r;
+    }
+};
+
+// Как trace и shade строят цвет нужного типа: обычный Vec3 учитывает только
+// включённые источники, LightLayers - ещё и выключенные переключаемые, каждый в своём слое
+template <class Color> struct Radiance;
+
+template <> struct Radiance<Vec3> {
+    static const bool kAllLights = false;
+    static Vec3 sky() { return kSkyColor; }
+    static Vec3 light(int, const Vec3& c) { return c; }
+};
+
+template <> struct Radiance<LightLayers> {
+    static const bool kAllLights = true;
+    static LightLayers sky() {
+        LightLayers r;
+        r.base = kSkyColor;
+        return r;
+    }
+    static LightLayers light(int i, const Vec3& c) {
+        LightLayers r;
+        if (i < LightLayers::kLights) r.light[i] = c;
+        else r.base = c;
+        return r;
+    }
+};
+
+// Вторичный луч, ожидающий трассировки, и его вес в итоговом цвете пикселя
+struct RayTask {
+    Vec3 orig, dir;
+    float weight;
+    int depth;
+};
+
+// Наибольшая глубина отскоков. Больше волновой трассировщик не различает
+// порядок вкладов (см. Wavefront::childKey), и рендерер её ограничивает.
+const int kMaxDepth = 32;
+
+// Стек отложенных лучей фиксированного размера. При обходе в глубину на
+// каждом уровне ждёт не больше одного луча, так что при maxDepth меньше
+// kCapacity стек не переполняется.
+struct RayStack {
+    static const int kCapacity = 64;
+    static_assert(kMaxDepth < kCapacity, "стек должен вмещать лучи всех уровней");
+
+    RayTask tasks[kCapacity];
+    int size = 0;
+
+    bool push(const RayTask& task) {
+        if (size == kCapacity) return false;
+        tasks[size++] = task;
+        return true;
+    }
+    RayTask pop() { return tasks[--size]; }
+    bool empty() const { return size == 0; }
+};
+
+// Детерминированное случайное число в [0, 1) для луча: не зависит от того,
+// какой поток и в каком порядке его трассирует
+inline float rayRandom(const Vec3& orig, const Vec3& dir) {
+    const float v[6] = {orig.x, orig.y, orig.z, dir.x, dir.y, dir.z};
+    std::uint32_t h = 2166136261u;
+    for (float f : v) {
+        std::uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        h = (h ^ bits) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Ключ связности луча: октант направления в трёх старших битах, ниже -
+// код Мортона начала луча, квантованного по 10 бит на ось внутри bounds.
+// Лучи с близкими ключами выходят из соседних точек в одну сторону и обходят
+// одни и те же узлы BVH. Начала вне bounds (попадания в плоскость)
+// прижимаются к границе.
+inline std::uint64_t coherenceKey(const Vec3& orig, const Vec3& dir, const AABB& bounds) {
+    auto cell = [](float v, float lo, float hi) -> std::uint64_t {
+        float a = hi > lo ? (v - lo) / (hi - lo) : 0.0f;
+        return (std::uint64_t)std::min(1023.0f, std::max(0.0f, a * 1024.0f));
+    };
+    auto spread = [](std::uint64_t v) {
+        v = (v | v << 16) & 0x030000FFull;
+        v = (v | v << 8) & 0x0300F00Full;
+        v = (v | v << 4) & 0x030C30C3ull;
+        v = (v | v << 2) & 0x09249249ull;
+        return v;
+    };
+    std::uint64_t morton = spread(cell(orig.x, bounds.min.x, bounds.max.x)) |
+                           spread(cell(orig.y, bounds.min.y, bounds.max.y)) << 1 |
+                           spread(cell(orig.z, bounds.min.z, bounds.max.z)) << 2;
+    std::uint64_t octant = (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+    return octant << 30 | morton;
+}
+
+// Отсечение вторичного луча по весу. Лучи с весом меньше ctx.minWeight
+// отбрасываются, а с русской рулеткой продолжаются с вероятностью
+// weight / minWeight и весом minWeight, что сохраняет среднее значение.
+// Возвращает false, если луч отброшен.
+inline bool keepRay(RayTask& t, TraceContext& ctx) {
+    if (t.weight < ctx.minWeight) {
+        if (!ctx.roulette || rayRandom(t.orig, t.dir) * ctx.minWeight >= t.weight) {
+            ctx.pruned++;
+            return false;
+        }
+        t.weight = ctx.minWeight;
+    }
+    return true;
+}
+
+// Кладёт в стек вторичный луч, если его не отсекает keepRay.
+// Возвращает false, если луч отброшен.
+inline bool pushRay(RayStack& stack, const RayTask& task, TraceContext& ctx) {
+    RayTask t = task;
+    if (!keepRay(t, ctx)) return false;
+    if (stack.push(t)) return true;
+    ctx.pruned++;
+    return false;
+}
+
+// Источники, которые учитываются в точке phit луча dir: fn(i, scale) для
+// каждого, где scale - множитель вклада. Если источников не больше
+// lights.samples, это все нужные источники, иначе - выборка LightSet::sample.
+template <class Color, class Fn>
+void forEachLight(const LightSet& lights, const Vec3& phit, const Vec3& dir, Fn&& fn) {
+    auto wanted = [&](int i) {
+        return lights.isOn(i) || (Radiance<Color>::kAllLights && i < LightLayers::kLights);
+    };
+    if (lights.exact()) {
+        for (int i = 0; i < lights.count(); i++) {
+            if (wanted(i)) fn(i, 1.0f);
+        }
+        return;
+    }
+    // Выборки расслоены: одно случайное число точки, сдвинутое на k / samples
+    float r = rayRandom(phit, dir);
+    for (int k = 0; k < lights.samples; k++) {
+        float u = r + (float)k / lights.samples;
+        if (u >= 1.0f) u -= 1.0f;
+        float pdf;
+        int i = lights.sample(phit, u, pdf);
+        if (i >= 0 && wanted(i)) fn(i, 1.0f / (pdf * lights.samples));
+    }
+}
+
+// Преломлённый и отражённый лучи точки phit поверхности с материалом material:
+// emit(task, refraction) сначала для преломлённого, затем для отражённого.
+// Вес лучей ещё не проверен keepRay.
+template <class Fn>
+void secondaryRays(const Vec3& dir, const Vec3& phit, const Vec3& nhit, const Material& material, float weight,
+                   int depth, int maxDepth, Fn&& emit) {
+    float kr = fresnel(dir, nhit, material.ior); // Коэффициент отражения
+    if (depth + 1 > maxDepth) return;
+
+    // Начало вторичного луча сдвигается на ту сторону поверхности, куда он
+    // уходит: иначе луч, выходящий из сетки, снова попадает в тот же треугольник
+    auto offset = [&](const Vec3& d) { return d.dot(nhit) < 0 ? phit - nhit * 1e-4f : phit + nhit * 1e-4f; };
+    if (material.refraction > 0.0f) {
+        Vec3 refrDir;
+        if (refract(dir, nhit, material.ior, refrDir)) {
+            refrDir = refrDir.normalize();
+            emit(RayTask{offset(refrDir), refrDir, weight * (1.0f - kr) * material.refraction, depth + 1}, true);
+        }
+    }
+    if (material.reflection > 0.0f) {
+        Vec3 reflDir = (dir - nhit * 2.0f * (dir.dot(nhit))).normalize();
+        emit(RayTask{offset(reflDir), reflDir, weight * kr * material.reflection, depth + 1}, false);
+    }
+}
+
+// Прямое освещение точки пересечения с весом weight. Отражённый и
+// преломлённый лучи не трассируются рекурсивно, а кладутся в stack.
+template <class Color>
+Color shadeSurface(const Vec3& orig, const Vec3& dir, const Hit& hit, float weight, int depth, const Scene& scene,
+                   const LightSet& lights, int maxDepth, RayStack& stack, TraceContext& ctx) {
+    Vec3 phit = orig + dir * hit.t;
+    Vec3 nhit = scene.normal(hit, phit);
+    LAB5_STAT(threadRayStats().maxDepth = std::max(threadRayStats().maxDepth, depth));
+
+    const Material& material = scene.material(hit);
+    const Vec3& hitColor = material.color;
+    float refl = material.reflection;
+    float refr = material.refraction;
+
+    // Вклад источника i, умноженный на scale
+    auto computeLight = [&](int i, float scale) {
+        const Light& light = lights[i];
+        Vec3 toLight = light.pos - phit;
+        Vec3 lightDir = toLight.normalize();
+        ctx.rays++;
+        LAB5_STAT(threadRayStats().shadow++);
+        bool shadow = inShadow(phit, nhit, light.pos, scene, ctx.occluderCache(i));
+        float shade = shadow ? 0.2f : std::max(0.0f, nhit.dot(lightDir));
+        float w = light.intensity * light.attenuation(toLight.dot(toLight)) * scale;
+        return Radiance<Color>::light(i, hitColor * (shade * w));
+    };
+
+    Color surfaceColor;
+    forEachLight<Color>(lights, phit, dir, [&](int i, float scale) { surfaceColor = surfaceColor + computeLight(i, scale); });
+
+    // Обработка отражений и преломлений
+    if (refl > 0.0f || refr > 0.0f) {
+        secondaryRays(dir, phit, nhit, material, weight, depth, maxDepth, [&](const RayTask& task, bool refraction) {
+            (void)refraction; // нужен только счётчикам LAB5_RAY_STATS
+            if (pushRay(stack, task, ctx)) {
+                LAB5_STAT(refraction ? threadRayStats().refraction++ : threadRayStats().reflection++);
+            }
+        });
+
+        surfaceColor = surfaceColor * (1.0f - (refl + refr));
+    }
+
+    return surfaceColor * weight;
+}
+
+// Освещение точки пересечения, найденной trace или пакетным ядром.
+// Вторичные лучи обходятся итеративно через RayStack.
+template <class Color = Vec3>
+Color shade(const Vec3& orig, const Vec3& dir, const Hit& hit, const Scene& scene, const LightSet& lights,
+            int depth, int maxDepth, TraceContext& ctx) {
+    RayStack stack;
+    Color result = shadeSurface<Color>(orig, dir, hit, 1.0f, depth, scene, lights, maxDepth, stack, ctx);
+
+    while (!stack.empty()) {
+        RayTask task = stack.pop();
+        ctx.rays++;
+        Hit next;
+        if (!scene.intersect(task.orig, task.dir, next)) {
+            result = result + Radiance<Color>::sky() * task.weight;
+            continue;
+        }
+        result = result + shadeSurface<Color>(task.orig, task.dir, next, task.weight, task.depth, scene,
+                                              lights, maxDepth, stack, ctx);
+    }
+
+    return result;
+}
+
+template <class Color = Vec3>
+Color trace(const Vec3& orig, const Vec3& dir, const Scene& scene, const LightSet& lights,
+            int depth, int maxDepth, TraceContext& ctx) {
+    if (depth > maxDepth) {
+        return Color();
+    }
+
+    ctx.rays++;
+    Hit hit;
+    if (!scene.intersect(orig, dir, hit)) {
+        return Radiance<Color>::sky(); // Цвет неба
+    }
+
+    return shade<Color>(orig, dir, hit, scene, lights, depth, maxDepth, ctx);
+}
+
+// Поле из множества маленьких сфер для проверки масштабируемости по размеру
+// сцены. glossy - доля зеркальных сфер.
+inline std::vector<Sphere> makeSphereField(int count, float glossy = 0.2f) {
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Sphere> spheres;
+    spheres.reserve(count);
+    for (int i = 0; i < count; i++) {
+        float r = 0.03f + 0.12f * unit(rng);
+        Vec3 c(-20.0f + 40.0f * unit(rng), -1.5f + r + 4.0f * unit(rng), -8.0f - 40.0f * unit(rng));
+        Vec3 col(unit(rng), unit(rng), unit(rng));
+        float refl = unit(rng) < glossy ? 0.5f : 0.0f;
+        spheres.emplace_back(c, r, col, refl, 0.0f, 1.0f);
+    }
+    return spheres;
+}
+
+// count слабых источников с затуханием над полем makeSphereField. Суммарная
+// мощность не зависит от count, чтобы кадр не пересвечивался.
+inline std::vector<Light> makeLightField(int count) {
+    std::mt19937 rng(67890);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Light> lights(count);
+    for (Light& l : lights) {
+        l.pos = Vec3(-20.0f + 40.0f * unit(rng), 0.5f + 4.0f * unit(rng), -8.0f - 40.0f * unit(rng));
+        l.intensity = (0.5f + unit(rng)) * 20.0f / (float)count;
+        l.range = 1.0f + 3.0f * unit(rng);
+    }
+    return lights;
+}
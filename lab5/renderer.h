@@ -0,0 +1,1075 @@
+#pragma once
+
+#include "arena.h"
+#include "raytracer.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Пул потоков с кражей работы: у каждого исполнителя своя очередь задач,
+// опустевший исполнитель забирает задачи с хвоста чужих очередей.
+// Вызывающий поток сам работает как исполнитель 0, поэтому при одном потоке
+// все задачи выполняются последовательно без создания дополнительных потоков.
+// Раздача задач не выделяет память: функция передаётся по ссылке, а очереди
+// исполнителей только растут.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount) : queues(std::max(1, threadCount)) {
+        for (int i = 1; i < (int)queues.size(); i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)queues.size(); }
+
+    // Выполняет fn(task, worker) для task из [0, taskCount) и ждёт завершения.
+    // Задачи раздаются исполнителям непрерывными блоками, чтобы соседние тайлы
+    // по возможности обрабатывались одним потоком. С interleave задачи
+    // раздаются по очереди: если они упорядочены по убыванию стоимости, каждый
+    // исполнитель начинает с самых дорогих, а кража забирает самые дешёвые.
+    template <class Fn>
+    void parallelFor(int taskCount, const Fn& fn, bool interleave = false) {
+        if (taskCount <= 0) return;
+
+        int workers = size();
+        job = &fn;
+        invoke = [](const void* f, int task, int worker) { (*static_cast<const Fn*>(f))(task, worker); };
+        pending.store(taskCount);
+        unclaimed.store(taskCount);
+        for (int w = 0; w < workers; w++) {
+            std::lock_guard<std::mutex> lock(queues[w].mutex);
+            // Прошлый parallelFor разобрал все задачи, очередь пуста
+            queues[w].tasks.clear();
+            queues[w].head = 0;
+            if (interleave) {
+                for (int t = w; t < taskCount; t += workers) queues[w].tasks.push_back(t);
+                continue;
+            }
+            int begin = (int)((long long)taskCount * w / workers);
+            int end = (int)((long long)taskCount * (w + 1) / workers);
+            for (int t = begin; t < end; t++) queues[w].tasks.push_back(t);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+        }
+        wake.notify_all();
+
+        drain(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending.load() == 0; });
+        job = nullptr;
+        invoke = nullptr;
+        tailMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drainedAt).count();
+    }
+
+    // Место в очередях под taskCount задач у каждого исполнителя
+    void reserve(int taskCount) {
+        for (WorkQueue& q : queues) {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.reserve(taskCount);
+        }
+    }
+
+    // Хвост последнего parallelFor: время от выдачи последней задачи до
+    // завершения всех, когда часть исполнителей уже простаивает
+    double lastTailMs() const { return tailMs; }
+
+private:
+    // Свои задачи берутся с head, украденные - с конца
+    struct WorkQueue {
+        std::mutex mutex;
+        std::vector<int> tasks;
+        size_t head = 0;
+    };
+
+    bool popLocal(int worker, int& task) {
+        WorkQueue& q = queues[worker];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.head == q.tasks.size()) return false;
+        task = q.tasks[q.head++];
+        return true;
+    }
+
+    bool steal(int worker, int& task) {
+        int workers = size();
+        for (int i = 1; i < workers; i++) {
+            WorkQueue& q = queues[(worker + i) % workers];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.head == q.tasks.size()) continue;
+            task = q.tasks.back();
+            q.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void drain(int worker) {
+        int task;
+        while (popLocal(worker, task) || steal(worker, task)) {
+            if (unclaimed.fetch_sub(1) == 1) drainedAt = std::chrono::steady_clock::now();
+            invoke(job, task, worker);
+            if (pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(int worker) {
+        unsigned long long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain(worker);
+        }
+    }
+
+    std::vector<WorkQueue> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long long generation = 0;
+    bool stopping = false;
+    std::atomic<int> pending{0};
+    std::atomic<int> unclaimed{0};
+    std::chrono::steady_clock::time_point drainedAt;
+    double tailMs = 0.0;
+    const void* job = nullptr;
+    void (*invoke)(const void* fn, int task, int worker) = nullptr;
+};
+
+// Способ трассировки пикселей тайла: каждый луч до конца по очереди (shade)
+// или стадиями сразу для всех лучей тайла (Wavefront). Изображение одно и то же.
+enum class TraceEngine { Recursive, Wavefront };
+
+inline const char* engineName(TraceEngine engine) {
+    return engine == TraceEngine::Wavefront ? "wavefront" : "recursive";
+}
+
+// Разбиение кадра на прямоугольные тайлы.
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+const int kTileSize = 32;
+static_assert((kTileSize & (kTileSize - 1)) == 0, "pixelIndex и zOrderCells рассчитаны на степень двойки");
+
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            tiles.push_back({x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)});
+        }
+    }
+    return tiles;
+}
+
+// Клетки квадрата kTileSize x kTileSize в порядке кривой Мортона (Z-порядок):
+// соседние по порядку клетки близки и по x, и по y, поэтому лучи одного пакета
+// почти параллельны и обходят одни и те же узлы BVH.
+struct PixelPos {
+    int x, y;
+};
+
+inline const std::vector<PixelPos>& zOrderCells() {
+    static const std::vector<PixelPos> cells = [] {
+        std::vector<PixelPos> c;
+        for (int i = 0; i < kTileSize * kTileSize; i++) {
+            int x = 0, y = 0;
+            for (int b = 0; (1 << (2 * b)) < kTileSize * kTileSize; b++) {
+                x |= ((i >> (2 * b)) & 1) << b;
+                y |= ((i >> (2 * b + 1)) & 1) << b;
+            }
+            c.push_back({x, y});
+        }
+        return c;
+    }();
+    return cells;
+}
+
+// Порядок обхода пикселей внутри тайла
+enum class Traversal { Rows, ZOrder };
+
+// Цвет шкалы тепловой карты для v из [0, 1]: синий, голубой, зелёный, жёлтый, красный
+inline Vec3 heatColor(float v) {
+    const Vec3 stops[] = {Vec3(0, 0, 1), Vec3(0, 1, 1), Vec3(0, 1, 0), Vec3(1, 1, 0), Vec3(1, 0, 0)};
+    float x = std::max(0.0f, std::min(1.0f, v)) * 4.0f;
+    int i = std::min(3, (int)x);
+    float a = x - i;
+    return stops[i] * (1.0f - a) + stops[i + 1] * a;
+}
+
+// Гамма-коррекция и перевод в 8 бит, как в исходном попиксельном коде
+inline std::uint8_t gammaByte(float c) {
+    float gamma = 2.2f;
+    c = std::pow(c, 1.0f / gamma);
+    return (std::uint8_t)(int)(std::max(0.0f, std::min(1.0f, c)) * 255);
+}
+
+// Сжатие HDR-цвета в [0, 1] перед гамма-коррекцией: обрезка (как раньше),
+// Reinhard c / (1 + c) или приближение ACES по Narkowicz
+enum class ToneMap { Clamp, Reinhard, ACES };
+
+inline const char* toneMapName(ToneMap op) {
+    return op == ToneMap::Reinhard ? "reinhard" : op == ToneMap::ACES ? "aces" : "clamp";
+}
+
+inline float toneMapValue(float c, ToneMap op) {
+    if (op == ToneMap::Reinhard) return c / (1.0f + c);
+    if (op == ToneMap::ACES) return (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+    return c;
+}
+
+#if defined(LAB5_X86)
+// x^(1/2.2) для x из [0, 1]: log2 через ряд для atanh, exp2 через ряд Тейлора.
+// Относительная погрешность порядка 1e-7, так что результат после квантования
+// отличается от std::pow не больше чем на единицу младшего разряда.
+inline __m128 gammaEncodeSSE(__m128 x) {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(1e-30f)), one);
+
+    __m128i bits = _mm_castps_si128(x);
+    __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+    // Мантисса в [sqrt(0.5), sqrt(2)), чтобы ряд сходился быстрее
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))), _mm_andnot_ps(big, m));
+    e = _mm_sub_epi32(e, _mm_castps_si128(big));
+
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 series = _mm_add_ps(_mm_set1_ps(1.0f / 5.0f), _mm_mul_ps(t2, _mm_set1_ps(1.0f / 7.0f)));
+    series = _mm_add_ps(_mm_set1_ps(1.0f / 3.0f), _mm_mul_ps(t2, series));
+    series = _mm_add_ps(one, _mm_mul_ps(t2, series));
+    __m128 lnM = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.0f), t), series);
+    __m128 log2x = _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(lnM, _mm_set1_ps(1.44269504f)));
+
+    __m128 y = _mm_mul_ps(log2x, _mm_set1_ps(1.0f / 2.2f));
+    __m128i n = _mm_cvtps_epi32(y);
+    __m128 z = _mm_mul_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(n)), _mm_set1_ps(0.693147181f));
+    __m128 p = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(z, _mm_set1_ps(1.0f / 720.0f)));
+    p = _mm_add_ps(_mm_set1_ps(1.0f / 24.0f), _mm_mul_ps(z, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f / 6.0f), _mm_mul_ps(z, p));
+    p = _mm_add_ps(_mm_set1_ps(0.5f), _mm_mul_ps(z, p));
+    p = _mm_add_ps(one, _mm_mul_ps(z, p));
+    p = _mm_add_ps(one, _mm_mul_ps(z, p));
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+    return _mm_and_ps(positive, _mm_mul_ps(p, scale));
+}
+#endif
+
+#if defined(LAB5_X86)
+// toneMapValue для четырёх значений, те же операции в том же порядке
+inline __m128 toneMapSSE(__m128 c, ToneMap op) {
+    if (op == ToneMap::Reinhard) return _mm_div_ps(c, _mm_add_ps(_mm_set1_ps(1.0f), c));
+    if (op == ToneMap::ACES) {
+        __m128 num = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(0.03f)));
+        __m128 den = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(0.59f))),
+                                _mm_set1_ps(0.14f));
+        return _mm_div_ps(num, den);
+    }
+    return c;
+}
+#endif
+
+// Выходная стадия: для пикселей [begin, end) складывает sourceCount
+// float-буферов (по 4 float на пиксель), умножает на scale (1 / число
+// накопленных кадров), сжимает оператором op, применяет гамма-коррекцию и
+// записывает RGBA. Векторный путь читает 16 байт на буфер и пишет 4 байта
+// на пиксель без обращений к std::pow.
+inline void resolvePixels(const float* const* sources, int sourceCount, float scale, ToneMap op,
+                          int begin, int end, std::uint8_t* rgba) {
+    int p = begin;
+#if defined(LAB5_X86)
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    const __m128 byteScale = _mm_set1_ps(255.0f);
+    const __m128 weight = _mm_set1_ps(scale);
+    for (; p + 4 <= end; p += 4) {
+        __m128i q[4];
+        for (int k = 0; k < 4; k++) {
+            __m128 c = _mm_loadu_ps(sources[0] + (p + k) * 4);
+            for (int i = 1; i < sourceCount; i++) c = _mm_add_ps(c, _mm_loadu_ps(sources[i] + (p + k) * 4));
+            c = toneMapSSE(_mm_mul_ps(c, weight), op);
+            q[k] = _mm_cvttps_epi32(_mm_mul_ps(gammaEncodeSSE(c), byteScale));
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128((__m128i*)&rgba[p * 4], _mm_or_si128(bytes, alpha));
+    }
+#endif
+    for (; p < end; p++) {
+        for (int c = 0; c < 3; c++) {
+            float v = sources[0][p * 4 + c];
+            for (int i = 1; i < sourceCount; i++) v += sources[i][p * 4 + c];
+            rgba[p * 4 + c] = gammaByte(toneMapValue(v * scale, op));
+        }
+        rgba[p * 4 + 3] = 255;
+    }
+}
+
+// Складывает слой неба и слои включённых источников для пикселей [begin, end)
+// и передаёт сумму выходной стадии resolvePixels
+inline void compositeLayers(const std::vector<std::vector<float>>& layers, const bool* lightOn, float scale,
+                            ToneMap op, int begin, int end, std::uint8_t* rgba) {
+    const float* sources[1 + LightLayers::kLights];
+    int sourceCount = 0;
+    sources[sourceCount++] = layers[0].data();
+    for (int i = 0; i + 1 < (int)layers.size(); i++) {
+        if (lightOn[i]) sources[sourceCount++] = layers[i + 1].data();
+    }
+    resolvePixels(sources, sourceCount, scale, op, begin, end, rgba);
+}
+
+// Трассировщик кадра по тайлам. Трассировка пишет линейный цвет во float-буфер
+// (HDR), а 8-битный RGBA получается из него отдельной выходной стадией
+// resolvePixels. В режиме слоёв вместо одного HDR-буфера - буферы вклада неба
+// и каждого из первых LightLayers::kLights источников, так что их
+// переключение требует только compositeLayers, без трассировки.
+// Все буферы кадра разложены по тайлам (см. pixelIndex); построчный RGBA
+// получается только при выводе, через copyPixels.
+class Renderer {
+public:
+    LightSet lights;
+    bool useLayers = false;
+    // Планирование по стоимости тайлов в прошлом кадре, см. planSchedule
+    bool costAware = true;
+    // Адаптивное сглаживание, см. refinePass: наибольшее число отсчётов на
+    // пиксель (квадрат стороны сетки; 1 - без сглаживания) и порог различия
+    // соседних пикселей в долях шкалы после гамма-коррекции
+    int aaSamples = 1;
+    float aaThreshold = 0.05f;
+    TraceEngine engine = TraceEngine::Recursive;
+    // Упорядочивать очередь отражённых и преломлённых лучей волнового
+    // трассировщика по направлению и началу перед пересечением
+    bool sortRays = false;
+    Traversal traversal = Traversal::ZOrder;
+    // Выходная стадия: множитель экспозиции и оператор сжатия HDR
+    ToneMap toneMap = ToneMap::Clamp;
+    float exposure = 1.0f;
+    // Накопление: до accumulate кадров render() со смещёнными внутри пикселя
+    // отсчётами усредняются в float-буферах, следующий кадр начинает заново.
+    // 1 - без накопления. Сглаживание refinePass при накоплении не нужно.
+    int accumulate = 1;
+
+    Renderer(const Scene& scene_, int width_, int height_, int maxDepth_, int threads, SimdLevel simd_)
+        : scene(scene_), width(width_), height(height_), maxDepth(std::min(maxDepth_, kMaxDepth)), simd(simd_), pool(threads),
+          contexts(pool.size()), tileBuffers(pool.size()), pixels((size_t)width_ * height_ * 4, 0),
+          tiles(makeTiles(width_, height_, kTileSize)), tileMs(tiles.size(), 0.0), aaExtra(pool.size(), 0) {
+        float fov = 60.0f;
+        aspectRatio = float(width) / float(height);
+        angle = std::tan((fov * 0.5f * M_PI / 180.0f));
+        reserveTasks();
+    }
+
+    int threadCount() const { return pool.size(); }
+    int frameWidth() const { return width; }
+    int frameHeight() const { return height; }
+
+    // Меняет разрешение кадра. Замеры тайлов и слои прошлого разрешения сбрасываются.
+    void resize(int width_, int height_) {
+        width = width_;
+        height = height_;
+        aspectRatio = float(width) / float(height);
+        pixels.assign((size_t)width * height * 4, 0);
+        tiles = makeTiles(width, height, kTileSize);
+        tileMs.assign(tiles.size(), 0.0);
+        hdr.clear();
+        layers.clear();
+        layersValid = false;
+        accumulated = 0;
+        reserveTasks();
+    }
+
+    // Время трассировки и сборки слоёв, накопленное с последнего resetStats(),
+    // и хвост трассировки - время, когда часть потоков уже закончила работу
+    double traceMs = 0.0;
+    double compositeMs = 0.0;
+    double tailMs = 0.0;
+
+    void resetStats() {
+        traceMs = 0.0;
+        compositeMs = 0.0;
+        tailMs = 0.0;
+        framePixels = 0;
+        std::fill(aaExtra.begin(), aaExtra.end(), 0);
+        for (auto& ctx : contexts) {
+            ctx.rays = 0;
+            ctx.pruned = 0;
+            ctx.stats = RayStats();
+        }
+    }
+
+    std::uint64_t rayCount() const {
+        std::uint64_t rays = 0;
+        for (auto& ctx : contexts) rays += ctx.rays;
+        return rays;
+    }
+
+    std::uint64_t prunedCount() const {
+        std::uint64_t pruned = 0;
+        for (auto& ctx : contexts) pruned += ctx.pruned;
+        return pruned;
+    }
+
+    // Счётчики всех исполнителей (ненулевые только при сборке с LAB5_RAY_STATS)
+    RayStats rayStats() const {
+        RayStats total;
+        for (auto& ctx : contexts) total.merge(ctx.stats);
+        return total;
+    }
+
+    // Среднее число отсчётов на пиксель с последнего resetStats(): 1 плюс
+    // дополнительные отсчёты сглаживания
+    double samplesPerPixel() const {
+        std::uint64_t extra = 0;
+        for (std::uint64_t n : aaExtra) extra += n;
+        return framePixels > 0 ? 1.0 + (double)extra / framePixels : 1.0;
+    }
+
+    // Время трассировки каждого тайла за последний кадр, по всем проходам
+    const std::vector<double>& tileTimes() const { return tileMs; }
+
+    // Порог веса вторичных лучей и русская рулетка, см. TraceContext
+    void setPruning(float minWeight, bool roulette) {
+        for (auto& ctx : contexts) {
+            ctx.minWeight = minWeight;
+            ctx.roulette = roulette;
+        }
+    }
+
+    // Полная трассировка кадра. При накоплении - очередной кадр в среднее:
+    // первый с отсчётом в центре пикселя, как без накопления, следующие -
+    // со смещениями из последовательности Халтона по основаниям 2 и 3.
+    void render() {
+        if (accumulate > 1) {
+            if (accumulated >= accumulate) accumulated = 0;
+            addSamples = accumulated > 0;
+            sampleX = addSamples ? radicalInverse(accumulated, 2) : 0.5f;
+            sampleY = addSamples ? radicalInverse(accumulated, 3) : 0.5f;
+            renderPass(1, 0, nullptr);
+            addSamples = false;
+            sampleX = sampleY = 0.5f;
+            return;
+        }
+        accumulated = 0;
+        renderPass(1, 0, nullptr);
+        refinePass(nullptr);
+    }
+
+    // Сколько кадров сейчас в среднем; resetAccumulation() начинает заново
+    int accumulatedFrames() const { return accumulated; }
+    void resetAccumulation() { accumulated = 0; }
+
+    // Кадр целиком заново: все accumulate проходов render(), без прежних кадров
+    // в среднем. Для кадров, между которыми сцена меняется или сравнивается
+    // другой способ трассировки.
+    void renderAccumulated() {
+        accumulated = 0;
+        for (int pass = 0; pass < accumulate; pass++) render();
+    }
+
+    // Прогрессивная трассировка: проходы с шагом 4, 2 и 1 пиксель, то есть
+    // 1/16, 1/4 и полное разрешение. Каждый пиксель трассируется один раз за
+    // все проходы, поэтому итог совпадает с render(); сглаживание - отдельный
+    // последний проход. После каждого прохода вызывается onPass. Если во время
+    // прохода установлен cancel, проход прерывается и функция возвращает false.
+    bool renderProgressive(const std::atomic<bool>& cancel, const std::function<void()>& onPass) {
+        const int steps[] = {4, 2, 1};
+        accumulated = 0;
+        int coarserStep = 0;
+        for (int step : steps) {
+            if (!renderPass(step, coarserStep, &cancel)) return false;
+            onPass();
+            coarserStep = step;
+        }
+        if (aaGridSide() > 1) {
+            if (!refinePass(&cancel)) return false;
+            onPass();
+        }
+        return true;
+    }
+
+    // Трассирует пиксели с координатами, кратными step, кроме уже вычисленных
+    // проходом с шагом coarserStep (0 - такого прохода не было), заливает
+    // их цветом блоки step x step и собирает из float-буферов RGBA
+    bool renderPass(int step, int coarserStep, const std::atomic<bool>* cancel) {
+        auto cancelled = [&] { return cancel && cancel->load(); };
+        auto start = std::chrono::steady_clock::now();
+        if (coarserStep == 0) {
+            reserveLights();
+            planSchedule();
+            std::fill(tileMs.begin(), tileMs.end(), 0.0);
+            framePixels += (std::uint64_t)width * height;
+        }
+        auto addTraceTime = [&] { addPassTime(start); };
+
+        if (useLayers) {
+            layers.resize(1 + LightLayers::kLights);
+            for (auto& layer : layers) layer.resize((size_t)width * height * 4);
+            layersValid = false;
+            pool.parallelFor((int)schedule.size(), [&](int t, int worker) {
+                taskMs[t] = 0.0;
+                if (cancelled()) return;
+                auto tileStart = std::chrono::steady_clock::now();
+                renderTile<LightLayers>(schedule[t].rect, step, coarserStep, worker,
+                                        [&](int x0, int y0, int x1, int y1, const LightLayers& col) {
+                    for (int y = y0; y < y1; y++) {
+                        for (int x = x0; x < x1; x++) {
+                            size_t i = pixelIndex(x, y) * 4;
+                            putLayer(layers[0], i, col.base);
+                            for (int l = 0; l < LightLayers::kLights; l++) putLayer(layers[l + 1], i, col.light[l]);
+                        }
+                    }
+                });
+                taskMs[t] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tileStart).count();
+            }, scheduleByCost);
+            addTraceTime();
+            shareArenaPeak();
+            if (cancelled()) return false;
+            layersValid = step == 1;
+            if (step == 1) accumulated++;
+            resolveAll();
+            return true;
+        }
+
+        hdr.resize((size_t)width * height * 4);
+        pool.parallelFor((int)schedule.size(), [&](int t, int worker) {
+            taskMs[t] = 0.0;
+            if (cancelled()) return;
+            taskMs[t] = renderPixels(schedule[t].rect, step, coarserStep, worker);
+        }, scheduleByCost);
+        addTraceTime();
+        shareArenaPeak();
+        if (cancelled()) return false;
+        if (step == 1) accumulated++;
+        resolveAll();
+        return true;
+    }
+
+    int tileCount() const { return (int)tiles.size(); }
+    const Tile& tile(int index) const { return tiles[index]; }
+
+    // Кадр построчно, RGBA, width * height * 4 байт
+    void copyPixels(std::vector<std::uint8_t>& rgba) const {
+        rgba.resize(pixels.size());
+        for (const Tile& t : tiles) {
+            size_t rowBytes = (size_t)(t.x1 - t.x0) * 4;
+            const std::uint8_t* src = tilePixels(t);
+            for (int y = t.y0; y < t.y1; y++, src += rowBytes) {
+                std::memcpy(&rgba[((size_t)y * width + t.x0) * 4], src, rowBytes);
+            }
+        }
+    }
+
+    // RGBA пиксели тайла makeTiles подряд, по строкам тайла
+    const std::uint8_t* tilePixels(const Tile& t) const { return &pixels[pixelIndex(t.x0, t.y0) * 4]; }
+
+    // Полная трассировка только тайлов [begin, end) в pixels; остальные
+    // пиксели не меняются. Используется исполнителем распределённого рендеринга.
+    void renderTiles(int begin, int end) {
+        auto start = std::chrono::steady_clock::now();
+        reserveLights();
+        hdr.resize((size_t)width * height * 4);
+        accumulated = 0;
+        pool.parallelFor(end - begin, [&](int t, int worker) {
+            tileMs[begin + t] = renderPixels(tiles[begin + t], 1, 0, worker);
+        });
+        shareArenaPeak();
+        traceMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        // Тайлы makeTiles идут в буферах друг за другом
+        const Tile& last = tiles[end - 1];
+        resolveRange((int)pixelIndex(tiles[begin].x0, tiles[begin].y0),
+                     (int)pixelIndex(last.x0, last.y0) + (last.x1 - last.x0) * (last.y1 - last.y0));
+    }
+
+    // Тепловая карта стоимости последнего кадра: каждый тайл окрашен по времени
+    // трассировки относительно самого медленного, а яркость изображения
+    // подмешивается, чтобы была видна сцена
+    std::vector<std::uint8_t> costHeatmap() const {
+        std::vector<std::uint8_t> heat(pixels.size());
+        double maxMs = *std::max_element(tileMs.begin(), tileMs.end());
+        for (size_t t = 0; t < tiles.size(); t++) {
+            Vec3 c = heatColor(maxMs > 0 ? (float)(tileMs[t] / maxMs) : 0.0f);
+            for (int y = tiles[t].y0; y < tiles[t].y1; y++) {
+                for (int x = tiles[t].x0; x < tiles[t].x1; x++) {
+                    size_t i = pixelIndex(x, y) * 4;
+                    float luma = (0.299f * pixels[i] + 0.587f * pixels[i + 1] + 0.114f * pixels[i + 2]) / 255.0f;
+                    Vec3 v = c * (0.6f + 0.4f * luma);
+                    std::uint8_t* out = &heat[((size_t)y * width + x) * 4];
+                    out[0] = (std::uint8_t)(v.x * 255);
+                    out[1] = (std::uint8_t)(v.y * 255);
+                    out[2] = (std::uint8_t)(v.z * 255);
+                    out[3] = 255;
+                }
+            }
+        }
+        return heat;
+    }
+
+    // Есть ли полный набор слоёв для последнего кадра
+    bool hasLayers() const { return useLayers && layersValid; }
+
+    // Собирает кадр из слоёв с текущими состояниями источников.
+    // Если полного набора слоёв ещё нет, выполняет полную трассировку.
+    void composite() {
+        if (!hasLayers()) {
+            render();
+            return;
+        }
+        resolveAll();
+    }
+
+private:
+    void addPassTime(std::chrono::steady_clock::time_point start) {
+        traceMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        tailMs += pool.lastTailMs();
+        for (size_t i = 0; i < schedule.size(); i++) tileMs[schedule[i].tile] += taskMs[i];
+    }
+
+    // Место под наибольшее число задач кадра, чтобы планирование по стоимости
+    // не выделяло память в кадрах, где тайлы делятся мельче прежнего
+    void reserveTasks() {
+        size_t maxTasks = tiles.size() * (kTileSize / kMinTaskSize) * (kTileSize / kMinTaskSize);
+        schedule.reserve(maxTasks);
+        taskMs.reserve(maxTasks);
+        pool.reserve((int)maxTasks);
+    }
+
+    // Каждая арена получает место под самый затратный тайл, который встречал
+    // любой поток: при кражах поток может получить тайл тяжелее всех своих
+    // прошлых, и без этого арена росла бы ещё несколько кадров
+    void shareArenaPeak() {
+        size_t peak = 0;
+        for (const TileBuffers& tb : tileBuffers) peak = std::max(peak, tb.arena.peak());
+        for (TileBuffers& tb : tileBuffers) tb.arena.reserve(peak);
+    }
+
+    // Кэши заслоняющих объектов всех потоков - под текущий набор источников
+    void reserveLights() {
+        for (TraceContext& ctx : contexts) ctx.reserveLights(lights.count());
+    }
+
+    int aaGridSide() const { return (int)std::sqrt((float)std::max(1, aaSamples)); }
+
+    // Адаптивное сглаживание готового кадра. Сначала отмечаются пиксели, у
+    // которых хотя бы один из четырёх соседей отличается в каком-либо канале
+    // больше чем на aaThreshold. Для каждого из них трассируются 4 отсчёта
+    // повёрнутой сетки, и если они вместе с центральным расходятся больше
+    // порога - остальные отсчёты сетки aaGridSide x aaGridSide; цвет пикселя -
+    // среднее всех отсчётов. Задачи те же, что у основного прохода, поэтому
+    // стоимость сглаживания попадает в tileMs и учитывается при планировании
+    // следующего кадра.
+    bool refinePass(const std::atomic<bool>* cancel) {
+        int side = aaGridSide();
+        if (side < 2) return true;
+        auto cancelled = [&] { return cancel && cancel->load(); };
+        auto start = std::chrono::steady_clock::now();
+
+        int limit = (int)(aaThreshold * 255.0f);
+        edgeMask.resize((size_t)width * height);
+        const int rowsPerTask = 16;
+        int tasks = (height + rowsPerTask - 1) / rowsPerTask;
+        pool.parallelFor(tasks, [&](int t, int) {
+            auto differs = [&](size_t a, size_t b) {
+                for (int c = 0; c < 3; c++) {
+                    if (std::abs(pixels[a * 4 + c] - pixels[b * 4 + c]) > limit) return true;
+                }
+                return false;
+            };
+            for (int y = t * rowsPerTask; y < std::min(height, (t + 1) * rowsPerTask); y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t i = pixelIndex(x, y);
+                    edgeMask[i] = (x > 0 && differs(i, pixelIndex(x - 1, y))) ||
+                                  (x + 1 < width && differs(i, pixelIndex(x + 1, y))) ||
+                                  (y > 0 && differs(i, pixelIndex(x, y - 1))) ||
+                                  (y + 1 < height && differs(i, pixelIndex(x, y + 1)));
+                }
+            }
+        });
+
+        pool.parallelFor((int)schedule.size(), [&](int t, int worker) {
+            taskMs[t] = 0.0;
+            if (cancelled()) return;
+            auto tileStart = std::chrono::steady_clock::now();
+            if (useLayers) {
+                auto load = [&](size_t i) {
+                    LightLayers col;
+                    col.base = loadLayer(layers[0], i * 4);
+                    for (int l = 0; l < LightLayers::kLights; l++) col.light[l] = loadLayer(layers[l + 1], i * 4);
+                    return col;
+                };
+                refineTile<LightLayers>(schedule[t].rect, side, limit, worker, load, [&](size_t i, const LightLayers& col) {
+                    storeLayer(layers[0], i * 4, col.base);
+                    for (int l = 0; l < LightLayers::kLights; l++) storeLayer(layers[l + 1], i * 4, col.light[l]);
+                });
+            } else {
+                auto load = [&](size_t i) { return loadLayer(hdr, i * 4); };
+                refineTile<Vec3>(schedule[t].rect, side, limit, worker, load, [&](size_t i, const Vec3& col) {
+                    storeLayer(hdr, i * 4, col);
+                });
+            }
+            taskMs[t] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tileStart).count();
+        }, scheduleByCost);
+        addPassTime(start);
+        if (cancelled()) return false;
+        resolveAll();
+        return true;
+    }
+
+    // Отсчёты сглаживания для отмеченных пикселей прямоугольника. load(i)
+    // возвращает цвет центрального отсчёта из основного прохода, store(i, col) -
+    // записывает средний цвет. Первые 4 отсчёта - ячейки сетки, ближайшие к
+    // повёрнутой сетке (RGSS): при стороне 4 это она и есть, при 2 - вся сетка
+    // 2x2; на почти горизонтальных и вертикальных краях она точнее прямой 2x2.
+    template <class Color, class Load, class Store>
+    void refineTile(const Tile& rect, int side, int limit, int worker, Load&& load, Store&& store) {
+        TraceContext& ctx = contexts[worker];
+#if defined(LAB5_RAY_STATS)
+        RayStatsScope statsScope(ctx.stats);
+#endif
+        const float rotated[4][2] = {{0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f}};
+        int firstCells[4];
+        for (int k = 0; k < 4; k++) firstCells[k] = (int)(rotated[k][1] * side) * side + (int)(rotated[k][0] * side);
+
+        for (int y = rect.y0; y < rect.y1; y++) {
+            for (int x = rect.x0; x < rect.x1; x++) {
+                size_t i = pixelIndex(x, y);
+                if (!edgeMask[i]) continue;
+
+                Color sum;
+                int count = 0;
+                int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+                auto add = [&](const Color& col) {
+                    Vec3 c = displayColor(col);
+                    const float channels[3] = {c.x, c.y, c.z};
+                    for (int k = 0; k < 3; k++) {
+                        int v = gammaByte(toneMapValue(channels[k] * exposure, toneMap));
+                        lo[k] = std::min(lo[k], v);
+                        hi[k] = std::max(hi[k], v);
+                    }
+                    sum = sum + col;
+                    count++;
+                };
+                auto sample = [&](int cell) {
+                    float px = x + (cell % side + 0.5f) / side, py = y + (cell / side + 0.5f) / side;
+                    LAB5_STAT(ctx.stats.primary++);
+                    add(trace<Color>(Vec3(0, 0, 0), sampleDir(px, py), scene, lights, 0, maxDepth, ctx));
+                };
+
+                add(load(i));
+                for (int cell : firstCells) sample(cell);
+                if (side > 2 && std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2])) > limit) {
+                    for (int cell = 0; cell < side * side; cell++) {
+                        if (std::find(firstCells, firstCells + 4, cell) == firstCells + 4) sample(cell);
+                    }
+                }
+                store(i, sum * (1.0f / count));
+                aaExtra[worker] += count - 1;
+            }
+        }
+    }
+
+    // Цвет, который увидит пользователь: для слоёв - сумма включённых
+    Vec3 displayColor(const Vec3& c) const { return c; }
+    Vec3 displayColor(const LightLayers& c) const {
+        Vec3 sum = c.base;
+        for (int l = 0; l < LightLayers::kLights; l++) {
+            if (l < lights.count() && lights.isOn(l)) sum = sum + c.light[l];
+        }
+        return sum;
+    }
+
+    // Индекс пикселя в буферах кадра. Тайлы makeTiles лежат друг за другом,
+    // внутри тайла - построчно с шагом его ширины, так что тайл, который
+    // трассирует один поток, занимает несколько соседних страниц памяти, а не
+    // по 128 байт в 32 строках кадра. Полосы тайлов тоже непрерывны: строки
+    // [y0, y1) полосы - это индексы [y0 * width, y1 * width).
+    size_t pixelIndex(int x, int y) const {
+        int x0 = x & ~(kTileSize - 1), y0 = y & ~(kTileSize - 1);
+        int tw = std::min(kTileSize, width - x0), th = std::min(kTileSize, height - y0);
+        return (size_t)y0 * width + (size_t)x0 * th + (size_t)(y - y0) * tw + (x - x0);
+    }
+
+    // Выходная стадия для всего кадра: полосы по 16 строк параллельно
+    void resolveAll() {
+        const int rowsPerTask = 16;
+        int tasks = (height + rowsPerTask - 1) / rowsPerTask;
+        pool.parallelFor(tasks, [&](int t, int) {
+            resolveRange(t * rowsPerTask * width, std::min(height, (t + 1) * rowsPerTask) * width);
+        });
+    }
+
+    // Перевод пикселей [begin, end) буферов кадра из float в RGBA: слои с
+    // текущими состояниями источников или HDR-буфер, среднее накопленных кадров
+    void resolveRange(int begin, int end) {
+        auto start = std::chrono::steady_clock::now();
+        float scale = exposure / std::max(1, accumulated);
+        if (useLayers) {
+            bool lightOn[LightLayers::kLights];
+            for (int i = 0; i < LightLayers::kLights; i++) lightOn[i] = i < lights.count() && lights.isOn(i);
+            compositeLayers(layers, lightOn, scale, toneMap, begin, end, pixels.data());
+        } else {
+            const float* source = hdr.data();
+            resolvePixels(&source, 1, scale, toneMap, begin, end, pixels.data());
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(compositeMutex);
+        compositeMs += ms;
+    }
+
+    // Трассирует прямоугольник тайла, пишет линейные цвета в hdr и
+    // возвращает время работы в миллисекундах
+    double renderPixels(const Tile& rect, int step, int coarserStep, int worker) {
+        auto start = std::chrono::steady_clock::now();
+        renderTile<Vec3>(rect, step, coarserStep, worker,
+                         [&](int x0, int y0, int x1, int y1, const Vec3& col) {
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) putLayer(hdr, pixelIndex(x, y) * 4, col);
+            }
+        });
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Порядок задач кадра. Без costAware или без замеров - тайлы по порядку.
+    // Иначе тайлы, которые в прошлом кадре заняли больше 1/kTasksPerThread
+    // доли работы одного потока, делятся на четверти (до kMinTaskSize), и все
+    // задачи сортируются по убыванию ожидаемой стоимости: дорогие начинаются
+    // первыми, а конец кадра добирается мелкими и дешёвыми задачами.
+    void planSchedule() {
+        const int kTasksPerThread = 8;
+
+        schedule.clear();
+        scheduleByCost = false;
+        double total = 0.0;
+        for (double ms : tileMs) total += ms;
+        if (!costAware || total <= 0.0) {
+            for (int t = 0; t < (int)tiles.size(); t++) schedule.push_back({tiles[t], t, 0.0});
+            taskMs.assign(schedule.size(), 0.0);
+            return;
+        }
+
+        double limit = total / (pool.size() * kTasksPerThread);
+        for (int t = 0; t < (int)tiles.size(); t++) splitTask(tiles[t], t, tileMs[t], limit);
+        // std::sort, а не stable_sort: тот выделяет временный буфер каждый кадр.
+        // Равные по стоимости задачи упорядочиваются по положению.
+        std::sort(schedule.begin(), schedule.end(), [](const TileTask& a, const TileTask& b) {
+            if (a.cost != b.cost) return a.cost > b.cost;
+            if (a.tile != b.tile) return a.tile < b.tile;
+            return a.rect.y0 != b.rect.y0 ? a.rect.y0 < b.rect.y0 : a.rect.x0 < b.rect.x0;
+        });
+        taskMs.assign(schedule.size(), 0.0);
+        scheduleByCost = true;
+    }
+
+    // Добавляет в schedule часть r тайла tile, деля её на четверти, пока
+    // стоимость больше limit
+    void splitTask(const Tile& r, int tile, double cost, double limit) {
+        // Границы частей кратны 4, чтобы блоки прогрессивных проходов не выходили за них
+        int w = r.x1 - r.x0, h = r.y1 - r.y0;
+        if (cost <= limit || w < 2 * kMinTaskSize || h < 2 * kMinTaskSize) {
+            schedule.push_back({r, tile, cost});
+            return;
+        }
+        int mx = r.x0 + w / 2 / 4 * 4, my = r.y0 + h / 2 / 4 * 4;
+        splitTask({r.x0, r.y0, mx, my}, tile, cost / 4, limit);
+        splitTask({mx, r.y0, r.x1, my}, tile, cost / 4, limit);
+        splitTask({r.x0, my, mx, r.y1}, tile, cost / 4, limit);
+        splitTask({mx, my, r.x1, r.y1}, tile, cost / 4, limit);
+    }
+
+    static Vec3 loadLayer(const std::vector<float>& layer, size_t i) {
+        return Vec3(layer[i + 0], layer[i + 1], layer[i + 2]);
+    }
+
+    static void storeLayer(std::vector<float>& layer, size_t i, const Vec3& c) {
+        layer[i + 0] = c.x;
+        layer[i + 1] = c.y;
+        layer[i + 2] = c.z;
+        layer[i + 3] = 0.0f;
+    }
+
+    // Запись отсчёта кадра: новый кадр или прибавление к накопленным
+    void putLayer(std::vector<float>& layer, size_t i, const Vec3& c) const {
+        if (!addSamples) {
+            storeLayer(layer, i, c);
+            return;
+        }
+        layer[i + 0] += c.x;
+        layer[i + 1] += c.y;
+        layer[i + 2] += c.z;
+    }
+
+    // Число 0.i1i2i3... из цифр index по основанию base
+    static float radicalInverse(int index, int base) {
+        float result = 0.0f, digit = 1.0f / base;
+        for (; index > 0; index /= base, digit /= base) result += (index % base) * digit;
+        return result;
+    }
+
+    Vec3 primaryDir(int x, int y) const {
+        return sampleDir(x + sampleX, y + sampleY);
+    }
+
+    // Направление луча через точку (px, py) кадра в пикселях
+    Vec3 sampleDir(float px, float py) const {
+        float xx = (2 * (px / (float)width) - 1) * angle * aspectRatio;
+        float yy = (1 - 2 * (py / (float)height)) * angle;
+
+        Vec3 rayDir(xx, yy, -1);
+        return rayDir.normalize();
+    }
+
+    // Пиксели тайла, выбранные проходом, в порядке traversal
+    void tilePixelOrder(const Tile& tile, int step, int coarserStep, ArenaArray<PixelPos>& out) const {
+        out.clear();
+        auto add = [&](int x, int y) {
+            if (x >= tile.x1 || y >= tile.y1) return;
+            if (coarserStep > 0 && y % coarserStep == 0 && x % coarserStep == 0) return;
+            out.push_back({x, y});
+        };
+        if (traversal == Traversal::ZOrder) {
+            // Клетки сетки с шагом step; тайл и его части не больше kTileSize
+            for (const PixelPos& c : zOrderCells()) add(tile.x0 + c.x * step, tile.y0 + c.y * step);
+        } else {
+            for (int y = tile.y0; y < tile.y1; y += step) {
+                for (int x = tile.x0; x < tile.x1; x += step) add(x, y);
+            }
+        }
+    }
+
+    // Трассирует выбранные проходом пиксели тайла и передаёт store(x0, y0, x1, y1, col)
+    // блок, который нужно залить цветом. Размер тайла кратен всем шагам проходов,
+    // поэтому блоки не выходят за пределы тайла.
+    template <class Color, class Store>
+    void renderTile(const Tile& tile, int step, int coarserStep, int worker, Store&& store) {
+        TraceContext& ctx = contexts[worker];
+#if defined(LAB5_RAY_STATS)
+        RayStatsScope statsScope(ctx.stats);
+#endif
+        auto fill = [&](int x, int y, const Color& col) {
+            store(x, y, std::min(x + step, tile.x1), std::min(y + step, tile.y1), col);
+        };
+
+        // Всё временное для тайла берётся из арены исполнителя
+        TileBuffers& tb = tileBuffers[worker];
+        tb.arena.reset();
+        ArenaArray<PixelPos> px;
+        px.bind(tb.arena);
+        tilePixelOrder(tile, step, coarserStep, px);
+        int count = (int)px.size();
+
+        if (engine == TraceEngine::Wavefront) {
+            Vec3* dirs = tb.arena.allocate<Vec3>(count);
+            for (int i = 0; i < count; i++) dirs[i] = primaryDir(px[i].x, px[i].y);
+            Wavefront<Color>& wave = tb.get((Color*)nullptr);
+            wave.trace(scene, lights, simd, maxDepth, ctx, dirs, count, tb.arena, sortRays);
+            for (int i = 0; i < count; i++) fill(px[i].x, px[i].y, wave.colors()[i]);
+            return;
+        }
+
+        int lanes = packetWidth(simd);
+        RayPacket packet;
+        packet.orig = Vec3(0, 0, 0);
+
+        int i = 0;
+        // Пакеты по lanes соседних в порядке обхода пикселей, остаток - по одному лучу
+        for (; lanes > 1 && i + lanes <= count; i += lanes) {
+            for (int k = 0; k < lanes; k++) {
+                Vec3 d = primaryDir(px[i + k].x, px[i + k].y);
+                packet.dx[k] = d.x;
+                packet.dy[k] = d.y;
+                packet.dz[k] = d.z;
+            }
+            intersectPacket(scene, simd, packet);
+            ctx.rays += lanes;
+            LAB5_STAT(ctx.stats.primary += lanes);
+            for (int k = 0; k < lanes; k++) {
+                Vec3 d(packet.dx[k], packet.dy[k], packet.dz[k]);
+                Hit hit;
+                hit.t = packet.t[k];
+                hit.prim = packet.hit[k];
+                hit.instance = packet.instance[k];
+                Color col = Radiance<Color>::sky();
+                if (hit.prim != -1) {
+                    col = shade<Color>(packet.orig, d, hit, scene, lights, 0, maxDepth, ctx);
+                }
+                fill(px[i + k].x, px[i + k].y, col);
+            }
+        }
+        for (; i < count; i++) {
+            LAB5_STAT(ctx.stats.primary++);
+            Color col = trace<Color>(Vec3(0, 0, 0), primaryDir(px[i].x, px[i].y), scene, lights, 0, maxDepth, ctx);
+            fill(px[i].x, px[i].y, col);
+        }
+    }
+
+    const Scene& scene;
+    int width, height, maxDepth;
+    float aspectRatio, angle;
+    SimdLevel simd;
+    ThreadPool pool;
+    // Кэши заслоняющих объектов и прочее состояние - отдельно для каждого потока
+    std::vector<TraceContext> contexts;
+    // Арена временных данных тайла и волновые трассировщики каждого потока
+    struct TileBuffers {
+        Arena arena;
+        Wavefront<Vec3> plain;
+        Wavefront<LightLayers> layered;
+
+        Wavefront<Vec3>& get(Vec3*) { return plain; }
+        Wavefront<LightLayers>& get(LightLayers*) { return layered; }
+    };
+    std::vector<TileBuffers> tileBuffers;
+    std::vector<std::uint8_t> pixels; // RGBA по тайлам, см. pixelIndex
+    std::vector<Tile> tiles;
+    std::vector<double> tileMs;
+    // Задачи текущего кадра: часть тайла tile и её ожидаемая стоимость
+    struct TileTask {
+        Tile rect;
+        int tile;
+        double cost;
+    };
+    std::vector<TileTask> schedule;
+    static const int kMinTaskSize = 8; // сторона, меньше которой задачи не делятся
+    bool scheduleByCost = false;
+    std::vector<double> taskMs; // время каждой задачи текущего прохода
+    std::vector<float> hdr; // линейный цвет (сумма накопленных кадров), по 4 float на пиксель
+    std::vector<std::vector<float>> layers; // небо и источники, по 4 float на пиксель
+    bool layersValid = false;
+    int accumulated = 0;     // кадров в hdr или слоях
+    bool addSamples = false; // текущий проход прибавляет к ним, а не заменяет
+    float sampleX = 0.5f, sampleY = 0.5f; // положение первичного отсчёта в пикселе
+    std::mutex compositeMutex;
+    std::vector<char> edgeMask; // пиксели, которые уточняет refinePass
+    std::uint64_t framePixels = 0;
+    std::vector<std::uint64_t> aaExtra; // дополнительные отсчёты каждого исполнителя
+};
@@ -0,0 +1,454 @@
+#pragma once
+
+// Файлы сцен: текстовый формат для ручного редактирования и двоичный для
+// больших сцен. Двоичный файл отображается в память и копируется прямо в
+// массивы Scene, вместе с готовой BVH, поэтому сцены из миллионов сфер
+// загружаются без перестроения дерева.
+//
+// Текстовый формат - по одной команде в строке, # начинает комментарий:
+//   light x y z [intensity [range]]            (range - расстояние, на котором вклад падает вдвое; 0 - без затухания)
+//   material r g b reflection refraction ior   (индексы по порядку, с 0)
+//   sphere x y z radius material
+//   plane nx ny nz d material
+//   geometry file.obj                           (сетка без экземпляров; индексы по порядку, с 0)
+//   mesh file.obj material                      (сетка и её экземпляр без преобразования)
+//   instance geometry material tx ty tz [rx ry rz [scale]]
+//   instance geometry material m00 m01 ... m23  (матрица 3x4 по строкам)
+// Пути к OBJ-файлам - относительно файла сцены, углы - в градусах.
+// Номер сферы (в анимациях) - её порядковый номер в текстовом файле; двоичный
+// файл хранит сферы в порядке листьев BVH и перестановку к исходному порядку,
+// так что преобразование в любую сторону номера не меняет.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "obj.h"
+#include "raytracer.h"
+
+// Заголовок двоичного файла. За ним подряд идут массивы:
+// источники (Light; до версии 4 - только 3 float положения), материалы (Material), sphereX, sphereY, sphereZ,
+// sphereRadius, sphereMaterial, planeNX, planeNY, planeNZ, planeD,
+// planeMaterial и узлы BVH, с версии 5 при nodeCount > 0 - sphereSlots (позиция
+// в массивах сферы с исходным номером i, int), затем meshCount сеток: SceneFileMesh и массивы
+// v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z и узлы BVH сетки, затем
+// instanceCount записей SceneFileInstance. Все поля - 4 байта, порядок байтов машины.
+struct SceneFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t lightCount;
+    std::uint32_t materialCount;
+    std::uint32_t sphereCount;
+    std::uint32_t planeCount;
+    std::uint32_t nodeCount; // 0 - BVH строится при загрузке
+    std::uint32_t meshCount;     // с версии 2
+    std::uint32_t instanceCount; // с версии 3
+};
+
+// В версии 2 перед записью шёл материал сетки, а каждая сетка была одним
+// экземпляром без преобразования
+struct SceneFileMesh {
+    std::uint32_t triangleCount;
+    std::uint32_t nodeCount;
+};
+
+struct SceneFileInstance {
+    std::uint32_t mesh;
+    std::uint32_t material;
+    float toWorld[12];
+};
+
+const char kSceneMagic[8] = {'L', 'A', 'B', '5', 'S', 'C', 'N', 0};
+const std::uint32_t kSceneVersion = 5;
+
+static_assert(sizeof(Material) == 6 * sizeof(float), "Material is stored in scene files as is");
+static_assert(sizeof(Light) == 5 * sizeof(float), "Light is stored in scene files as is");
+static_assert(sizeof(BVHNode) == 32, "BVHNode is stored in scene files as is");
+
+// Читает подряд идущий массив из count элементов в v
+template <class T>
+bool readArray(const char*& p, const char* end, std::uint32_t count, std::vector<T>& v) {
+    size_t bytes = (size_t)count * sizeof(T);
+    if ((size_t)(end - p) < bytes) return false;
+    v.resize(count);
+    if (bytes) std::memcpy(v.data(), p, bytes);
+    p += bytes;
+    return true;
+}
+
+// Ссылаются ли узлы только на существующие узлы и примитивы и помещается ли
+// обход дерева в стек BVH::kStackSize. Потомки всегда дальше в массиве, чем
+// предок, поэтому глубины считаются за один проход.
+inline bool validNodes(const std::vector<BVHNode>& nodes, int primCount) {
+    std::vector<int> depth(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const BVHNode& n = nodes[i];
+        if (n.count > 0 ? n.rightOrFirst < 0 || n.rightOrFirst + n.count > primCount
+                        : n.count < 0 || n.rightOrFirst <= (int)i + 1 || n.rightOrFirst >= (int)nodes.size()) {
+            return false;
+        }
+        if (n.count > 0) continue;
+        if (depth[i] + 1 > BVH::kStackSize) return false;
+        for (int child : {(int)i + 1, n.rightOrFirst}) depth[child] = std::max(depth[child], depth[i] + 1);
+    }
+    return true;
+}
+
+// Является ли slots перестановкой номеров сфер (пустой - порядок не менялся)
+inline bool validSlots(const std::vector<int>& slots) {
+    std::vector<char> seen(slots.size(), 0);
+    for (int s : slots) {
+        if (s < 0 || s >= (int)slots.size() || seen[s]) return false;
+        seen[s] = 1;
+    }
+    return true;
+}
+
+inline bool loadSceneBinary(const MappedFile& file, Scene& scene, std::vector<Light>& lights, std::string& error) {
+    const char* p = file.data();
+    const char* end = p + file.size();
+    SceneFileHeader h = SceneFileHeader();
+    // Заголовки прежних версий - начало нынешнего
+    const size_t headerSize[] = {0, offsetof(SceneFileHeader, meshCount), offsetof(SceneFileHeader, instanceCount),
+                                 sizeof(h), sizeof(h), sizeof(h)};
+    if (file.size() < headerSize[1]) {
+        error = "scene file header is truncated";
+        return false;
+    }
+    std::memcpy(&h, p, headerSize[1]);
+    if (h.version < 1 || h.version > kSceneVersion) {
+        error = "unsupported scene file version " + std::to_string(h.version);
+        return false;
+    }
+    if (file.size() < headerSize[h.version]) {
+        error = "scene file header is truncated";
+        return false;
+    }
+    std::memcpy(&h, p, headerSize[h.version]);
+    p += headerSize[h.version];
+
+    std::vector<float> lightCoords;
+    lights.clear();
+    bool ok = (h.version >= 4 ? readArray(p, end, h.lightCount, lights) : readArray(p, end, h.lightCount * 3, lightCoords)) &&
+              readArray(p, end, h.materialCount, scene.materials) &&
+              readArray(p, end, h.sphereCount, scene.sphereX) &&
+              readArray(p, end, h.sphereCount, scene.sphereY) &&
+              readArray(p, end, h.sphereCount, scene.sphereZ) &&
+              readArray(p, end, h.sphereCount, scene.sphereRadius) &&
+              readArray(p, end, h.sphereCount, scene.sphereMaterial) &&
+              readArray(p, end, h.planeCount, scene.planeNX) &&
+              readArray(p, end, h.planeCount, scene.planeNY) &&
+              readArray(p, end, h.planeCount, scene.planeNZ) &&
+              readArray(p, end, h.planeCount, scene.planeD) &&
+              readArray(p, end, h.planeCount, scene.planeMaterial) &&
+              readArray(p, end, h.nodeCount, scene.bvh.nodes) &&
+              (h.version < 5 || h.nodeCount == 0 || readArray(p, end, h.sphereCount, scene.sphereSlots));
+
+    auto readRecord = [&](void* record, size_t size) {
+        ok = ok && (size_t)(end - p) >= size;
+        if (ok) {
+            std::memcpy(record, p, size);
+            p += size;
+        }
+        return ok;
+    };
+
+    // Число записей из заголовка сверяется с остатком файла до выделения памяти
+    ok = ok && h.meshCount <= (size_t)(end - p) / sizeof(SceneFileMesh) &&
+         h.instanceCount <= (size_t)(end - p) / sizeof(SceneFileInstance);
+    if (ok) scene.meshes.resize(h.meshCount);
+    for (std::uint32_t m = 0; ok && m < h.meshCount; m++) {
+        Mesh& mesh = scene.meshes[m];
+        if (h.version == 2) {
+            std::uint32_t material;
+            if (!readRecord(&material, sizeof(material))) break;
+            scene.addInstance((int)m, (int)material, Transform());
+        }
+        SceneFileMesh mh;
+        if (!readRecord(&mh, sizeof(mh))) break;
+        for (auto* v : {&mesh.v0x, &mesh.v0y, &mesh.v0z, &mesh.e1x, &mesh.e1y, &mesh.e1z, &mesh.e2x, &mesh.e2y, &mesh.e2z}) {
+            ok = ok && readArray(p, end, mh.triangleCount, *v);
+        }
+        ok = ok && readArray(p, end, mh.nodeCount, mesh.bvh.nodes);
+    }
+    for (std::uint32_t i = 0; i < h.instanceCount; i++) {
+        SceneFileInstance ih;
+        if (!readRecord(&ih, sizeof(ih))) break;
+        Transform toWorld;
+        std::memcpy(toWorld.m, ih.toWorld, sizeof(toWorld.m));
+        scene.addInstance((int)ih.mesh, (int)ih.material, toWorld);
+    }
+    if (!ok || p != end) {
+        error = "scene file size does not match its header";
+        return false;
+    }
+
+    for (size_t i = 0; i < lightCoords.size(); i += 3) {
+        Light light;
+        light.pos = Vec3(lightCoords[i], lightCoords[i + 1], lightCoords[i + 2]);
+        lights.push_back(light);
+    }
+
+    // Индексы проверяются, чтобы повреждённый файл не приводил к выходу за массивы
+    for (int m : scene.sphereMaterial) {
+        if (m < 0 || m >= (int)h.materialCount) ok = false;
+    }
+    for (int m : scene.planeMaterial) {
+        if (m < 0 || m >= (int)h.materialCount) ok = false;
+    }
+    ok = ok && validNodes(scene.bvh.nodes, (int)h.sphereCount) && validSlots(scene.sphereSlots);
+    for (const Mesh& mesh : scene.meshes) {
+        ok = ok && validNodes(mesh.bvh.nodes, mesh.triangleCount());
+    }
+    for (const Instance& inst : scene.instances) {
+        ok = ok && inst.mesh >= 0 && inst.mesh < (int)h.meshCount && inst.material >= 0 && inst.material < (int)h.materialCount;
+    }
+    if (!ok) {
+        error = "scene file has out of range indices";
+        return false;
+    }
+
+    for (Mesh& mesh : scene.meshes) {
+        if (mesh.bvh.empty()) mesh.build();
+    }
+    if (h.nodeCount == 0) {
+        scene.build();
+    } else {
+        scene.buildInstances();
+    }
+    return true;
+}
+
+inline bool loadSceneText(const MappedFile& file, const std::string& baseDir, Scene& scene, std::vector<Light>& lights,
+                          std::string& error) {
+    const char* p = file.data();
+    const char* end = p + file.size();
+    char line[512];
+    int lineNumber = 0;
+
+    lights.clear();
+    while (p < end) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        lineNumber++;
+        size_t length = std::min((size_t)(eol - p), sizeof(line) - 1);
+        std::memcpy(line, p, length);
+        line[length] = 0;
+        p = eol + 1;
+
+        if (char* comment = std::strchr(line, '#')) *comment = 0;
+
+        char command[16];
+        int consumed = 0;
+        if (std::sscanf(line, "%15s%n", command, &consumed) != 1) continue;
+
+        float v[14];
+        int count = 0;
+        char* s = line + consumed;
+        for (char* next; count < 14; count++) {
+            v[count] = std::strtof(s, &next);
+            if (next == s) break;
+            s = next;
+        }
+
+        auto expect = [&](int n) {
+            if (count == n) return true;
+            error = "line " + std::to_string(lineNumber) + ": '" + command + "' expects " + std::to_string(n) + " numbers";
+            return false;
+        };
+        auto materialIndex = [&](float m) {
+            if (m >= 0 && m < (float)scene.materials.size() && m == (int)m) return true;
+            error = "line " + std::to_string(lineNumber) + ": unknown material " + std::to_string(m);
+            return false;
+        };
+
+        if (std::strcmp(command, "light") == 0) {
+            if (count < 3 || count > 5) {
+                error = "line " + std::to_string(lineNumber) + ": 'light' expects 3, 4 or 5 numbers";
+                return false;
+            }
+            Light light;
+            light.pos = Vec3(v[0], v[1], v[2]);
+            if (count > 3) light.intensity = v[3];
+            if (count > 4) light.range = v[4];
+            if (light.intensity < 0) {
+                error = "line " + std::to_string(lineNumber) + ": negative light intensity";
+                return false;
+            }
+            lights.push_back(light);
+        } else if (std::strcmp(command, "material") == 0) {
+            if (!expect(6)) return false;
+            scene.addMaterial({Vec3(v[0], v[1], v[2]), v[3], v[4], v[5]});
+        } else if (std::strcmp(command, "sphere") == 0) {
+            if (!expect(5) || !materialIndex(v[4])) return false;
+            scene.addSphere(Vec3(v[0], v[1], v[2]), v[3], (int)v[4]);
+        } else if (std::strcmp(command, "plane") == 0) {
+            if (!expect(5) || !materialIndex(v[4])) return false;
+            scene.addPlane(Vec3(v[0], v[1], v[2]), v[3], (int)v[4]);
+        } else if (std::strcmp(command, "geometry") == 0 || std::strcmp(command, "mesh") == 0) {
+            bool instanced = command[0] == 'm';
+            char file[256];
+            int material = 0;
+            if (std::sscanf(line + consumed, "%255s %d", file, &material) != (instanced ? 2 : 1)) {
+                error = "line " + std::to_string(lineNumber) + ": '" + command + "' expects a file name" +
+                        (instanced ? " and a material" : "");
+                return false;
+            }
+            if (instanced && !materialIndex((float)material)) return false;
+            Mesh mesh;
+            if (!loadOBJ(file[0] == '/' ? file : baseDir + file, mesh, error)) return false;
+            scene.meshes.push_back(std::move(mesh));
+            if (instanced) scene.addInstance((int)scene.meshes.size() - 1, material, Transform());
+        } else if (std::strcmp(command, "instance") == 0) {
+            if (count != 5 && count != 8 && count != 9 && count != 14) {
+                error = "line " + std::to_string(lineNumber) + ": 'instance' expects geometry, material and 3, 6, 7 or 12 numbers";
+                return false;
+            }
+            if (v[0] < 0 || v[0] >= (float)scene.meshes.size() || v[0] != (int)v[0]) {
+                error = "line " + std::to_string(lineNumber) + ": unknown geometry " + std::to_string(v[0]);
+                return false;
+            }
+            if (!materialIndex(v[1])) return false;
+            Transform toWorld;
+            if (count == 14) {
+                std::memcpy(toWorld.m, v + 2, sizeof(toWorld.m));
+            } else {
+                Vec3 rotate = count >= 8 ? Vec3(v[5], v[6], v[7]) : Vec3();
+                toWorld = Transform::fromTRS(Vec3(v[2], v[3], v[4]), rotate, count == 9 ? v[8] : 1.0f);
+            }
+            scene.addInstance((int)v[0], (int)v[1], toWorld);
+        } else {
+            error = "line " + std::to_string(lineNumber) + ": unknown command '" + command + "'";
+            return false;
+        }
+    }
+
+    scene.build();
+    return true;
+}
+
+// Загружает сцену из файла в любом из двух форматов; формат определяется по
+// заголовку. scene должна быть пустой.
+inline bool loadScene(const std::string& path, Scene& scene, std::vector<Light>& lights, std::string& error) {
+    MappedFile file(path);
+    if (!file.ok()) {
+        error = "cannot open " + path;
+        return false;
+    }
+    if (file.size() >= sizeof(kSceneMagic) && std::memcmp(file.data(), kSceneMagic, sizeof(kSceneMagic)) == 0) {
+        return loadSceneBinary(file, scene, lights, error);
+    }
+    size_t slash = path.rfind('/');
+    return loadSceneText(file, slash == std::string::npos ? "" : path.substr(0, slash + 1), scene, lights, error);
+}
+
+inline bool saveSceneBinary(const std::string& path, const Scene& scene, const std::vector<Light>& lights) {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+
+    SceneFileHeader h;
+    std::memcpy(h.magic, kSceneMagic, sizeof(kSceneMagic));
+    h.version = kSceneVersion;
+    h.lightCount = (std::uint32_t)lights.size();
+    h.materialCount = (std::uint32_t)scene.materials.size();
+    h.sphereCount = (std::uint32_t)scene.sphereCount();
+    h.planeCount = (std::uint32_t)scene.planeCount();
+    h.nodeCount = (std::uint32_t)scene.bvh.nodes.size();
+    h.meshCount = (std::uint32_t)scene.meshes.size();
+    h.instanceCount = (std::uint32_t)scene.instances.size();
+
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    auto write = [&](const auto& v) {
+        if (!v.empty()) ok = ok && std::fwrite(v.data(), sizeof(v[0]), v.size(), f) == v.size();
+    };
+    write(lights);
+    write(scene.materials);
+    write(scene.sphereX);
+    write(scene.sphereY);
+    write(scene.sphereZ);
+    write(scene.sphereRadius);
+    write(scene.sphereMaterial);
+    write(scene.planeNX);
+    write(scene.planeNY);
+    write(scene.planeNZ);
+    write(scene.planeD);
+    write(scene.planeMaterial);
+    write(scene.bvh.nodes);
+    if (!scene.bvh.nodes.empty()) {
+        // Сцена из двоичного файла прежних версий уже в исходном порядке
+        std::vector<int> slots(scene.sphereCount());
+        for (int i = 0; i < scene.sphereCount(); i++) slots[i] = scene.sphereSlot(i);
+        write(slots);
+    }
+    for (const Mesh& mesh : scene.meshes) {
+        SceneFileMesh mh = {(std::uint32_t)mesh.triangleCount(), (std::uint32_t)mesh.bvh.nodes.size()};
+        ok = ok && std::fwrite(&mh, sizeof(mh), 1, f) == 1;
+        for (const auto* v : {&mesh.v0x, &mesh.v0y, &mesh.v0z, &mesh.e1x, &mesh.e1y, &mesh.e1z, &mesh.e2x, &mesh.e2y, &mesh.e2z}) {
+            write(*v);
+        }
+        write(mesh.bvh.nodes);
+    }
+    for (const Instance& inst : scene.instances) {
+        SceneFileInstance ih;
+        ih.mesh = (std::uint32_t)inst.mesh;
+        ih.material = (std::uint32_t)inst.material;
+        std::memcpy(ih.toWorld, inst.toWorld.m, sizeof(ih.toWorld));
+        ok = ok && std::fwrite(&ih, sizeof(ih), 1, f) == 1;
+    }
+    return std::fclose(f) == 0 && ok;
+}
+
+// Числа записываются с 9 значащими цифрами, чтобы float читался обратно без потерь.
+// Сетки сохраняются рядом в файлы <path>.mesh<i>.obj.
+inline bool saveSceneText(const std::string& path, const Scene& scene, const std::vector<Light>& lights) {
+    std::FILE* f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+    bool ok = true;
+
+    for (const Light& l : lights) {
+        std::fprintf(f, "light %.9g %.9g %.9g", l.pos.x, l.pos.y, l.pos.z);
+        if (l.intensity != 1.0f || l.range != 0.0f) std::fprintf(f, " %.9g %.9g", l.intensity, l.range);
+        std::fprintf(f, "\n");
+    }
+    for (const Material& m : scene.materials) {
+        std::fprintf(f, "material %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                     m.color.x, m.color.y, m.color.z, m.reflection, m.refraction, m.ior);
+    }
+    // В исходном порядке, а не в порядке листьев: на номера сфер ссылаются анимации
+    for (int i = 0; i < scene.sphereCount(); i++) {
+        int s = scene.sphereSlot(i);
+        std::fprintf(f, "sphere %.9g %.9g %.9g %.9g %d\n",
+                     scene.sphereX[s], scene.sphereY[s], scene.sphereZ[s], scene.sphereRadius[s], scene.sphereMaterial[s]);
+    }
+    for (int j = 0; j < scene.planeCount(); j++) {
+        std::fprintf(f, "plane %.9g %.9g %.9g %.9g %d\n",
+                     scene.planeNX[j], scene.planeNY[j], scene.planeNZ[j], scene.planeD[j], scene.planeMaterial[j]);
+    }
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        std::string meshPath = path + ".mesh" + std::to_string(m) + ".obj";
+        ok = ok && saveOBJ(meshPath, scene.meshes[m]);
+        size_t slash = meshPath.rfind('/');
+        std::fprintf(f, "geometry %s\n", meshPath.c_str() + (slash == std::string::npos ? 0 : slash + 1));
+    }
+    for (const Instance& inst : scene.instances) {
+        std::fprintf(f, "instance %d %d", inst.mesh, inst.material);
+        for (float x : inst.toWorld.m) std::fprintf(f, " %.9g", x);
+        std::fprintf(f, "\n");
+    }
+    ok = ok && !std::ferror(f);
+    return std::fclose(f) == 0 && ok;
+}
+
+// Записывает сцену в двоичном формате, если имя файла оканчивается на .bscene,
+// иначе - в текстовом
+inline bool saveScene(const std::string& path, const Scene& scene, const std::vector<Light>& lights) {
+    const std::string ext = ".bscene";
+    bool binary = path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+    return binary ? saveSceneBinary(path, scene, lights) : saveSceneText(path, scene, lights);
+}
@@ -0,0 +1,124 @@
+// Утилита для файлов сцен:
+//   SceneTool convert <in> <out>      - перевод между текстовым и двоичным (.bscene) форматами
+//   SceneTool generate <count> <out> [lights] - пол, два источника, поле из count сфер
+//                                       и lights дополнительных источников с затуханием
+//   SceneTool scatter <obj> <count> <out> - то же, но вместо сфер count экземпляров сетки
+//   SceneTool info <in>               - число примитивов и время загрузки
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "raytracer.h"
+#include "scenefile.h"
+
+namespace {
+
+int usage() {
+    std::cerr << "usage: SceneTool convert <in> <out>\n"
+                 "       SceneTool generate <count> <out> [lights]\n"
+                 "       SceneTool scatter <obj> <count> <out>\n"
+                 "       SceneTool info <in>\n";
+    return 2;
+}
+
+bool load(const std::string& path, Scene& scene, std::vector<Light>& lights, double& ms) {
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+    if (!loadScene(path, scene, lights, error)) {
+        std::cerr << path << ": " << error << std::endl;
+        return false;
+    }
+    ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+bool save(const std::string& path, const Scene& scene, const std::vector<Light>& lights) {
+    if (!saveScene(path, scene, lights)) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) return usage();
+    std::string command = argv[1];
+
+    Scene scene;
+    std::vector<Light> lights;
+    double loadMs = 0.0;
+
+    if (command == "convert" && argc == 4) {
+        if (!load(argv[2], scene, lights, loadMs)) return 1;
+        return save(argv[3], scene, lights) ? 0 : 1;
+    }
+
+    if (command == "generate" && (argc == 4 || argc == 5)) {
+        int count = std::max(0, std::atoi(argv[2]));
+        lights = {{Vec3(-2, 5, -3)}, {Vec3(2, 5, -2)}};
+        if (argc == 5) {
+            std::vector<Light> extra = makeLightField(std::max(0, std::atoi(argv[4])));
+            lights.insert(lights.end(), extra.begin(), extra.end());
+        }
+        scene.addPlane(Vec3(0, 1, 0), 1.5f, scene.addMaterial({Vec3(1.0f, 1.0f, 1.0f), 0.1f, 0.0f, 1.0f}));
+        for (const Sphere& s : makeSphereField(count)) s.addTo(scene);
+        scene.build();
+        return save(argv[3], scene, lights) ? 0 : 1;
+    }
+
+    if (command == "scatter" && argc == 5) {
+        Mesh mesh;
+        std::string error;
+        if (!loadOBJ(argv[2], mesh, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        scene.meshes.push_back(std::move(mesh));
+
+        // Экземпляры занимают место сфер makeSphereField: сетка вписывается
+        // в сферу того же радиуса и случайно поворачивается
+        AABB box = scene.meshes[0].bounds();
+        Vec3 center = box.centroid();
+        float size = std::max(0.5f * (box.max - box.min).length(), 1e-6f);
+        std::mt19937 rng(54321);
+        std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+
+        lights = {{Vec3(-2, 5, -3)}, {Vec3(2, 5, -2)}};
+        scene.addPlane(Vec3(0, 1, 0), 1.5f, scene.addMaterial({Vec3(1.0f, 1.0f, 1.0f), 0.1f, 0.0f, 1.0f}));
+        for (const Sphere& s : makeSphereField(std::max(0, std::atoi(argv[3])))) {
+            int material = scene.addMaterial({s.color, s.reflection, s.refraction, s.ior});
+            float scale = s.radius / size;
+            Transform t = Transform::fromTRS(s.center, Vec3(angle(rng), angle(rng), angle(rng)), scale);
+            // Центр сетки совмещается с центром сферы
+            Vec3 shift = t.vector(center);
+            t.m[3] -= shift.x;
+            t.m[7] -= shift.y;
+            t.m[11] -= shift.z;
+            scene.addInstance(0, material, t);
+        }
+        scene.build();
+        return save(argv[4], scene, lights) ? 0 : 1;
+    }
+
+    if (command == "info" && argc == 3) {
+        if (!load(argv[2], scene, lights, loadMs)) return 1;
+        long long triangles = 0;
+        for (const Mesh& mesh : scene.meshes) triangles += mesh.triangleCount();
+        std::cout << "lights: " << lights.size() << "\n"
+                  << "materials: " << scene.materials.size() << "\n"
+                  << "spheres: " << scene.sphereCount() << "\n"
+                  << "planes: " << scene.planeCount() << "\n"
+                  << "meshes: " << scene.meshes.size() << ", triangles: " << triangles << "\n"
+                  << "instances: " << scene.instances.size() << "\n"
+                  << "BVH nodes: " << scene.bvh.nodes.size() << "\n"
+                  << "load: " << loadMs << " ms" << std::endl;
+        return 0;
+    }
+
+    return usage();
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+// Потоковые сокеты для распределённого рендеринга. Адрес - unix:/path для
+// Unix-сокета, host:port или просто port (тогда 127.0.0.1) для TCP.
+// Сообщение - заголовок MessageHeader и size байт данных.
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct MessageHeader {
+    std::uint32_t type;
+    std::uint32_t size;
+};
+
+namespace detail {
+
+// Открывает сокет по адресу и либо слушает его, либо подключается к нему
+inline int openSocket(const std::string& address, bool listen, std::string& error) {
+    const std::string unixPrefix = "unix:";
+    if (address.compare(0, unixPrefix.size(), unixPrefix) == 0) {
+        std::string path = address.substr(unixPrefix.size());
+        sockaddr_un addr{};
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            error = "bad socket path '" + path + "'";
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return -1;
+        }
+        if (listen) ::unlink(path.c_str()); // сокет, оставшийся от прошлого запуска
+        int rc = listen ? ::bind(fd, (sockaddr*)&addr, sizeof(addr)) : ::connect(fd, (sockaddr*)&addr, sizeof(addr));
+        if (rc != 0 || (listen && ::listen(fd, 64) != 0)) {
+            error = address + ": " + std::strerror(errno);
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen ? AI_PASSIVE : 0;
+    addrinfo* list = nullptr;
+    int gai = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list);
+    if (gai != 0) {
+        error = address + ": " + ::gai_strerror(gai);
+        return -1;
+    }
+
+    int fd = -1;
+    error = address + ": no usable address";
+    for (addrinfo* a = list; a; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        if (listen) {
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (::bind(fd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(fd, 64) == 0) break;
+        } else if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            // Тайлы отправляются отдельными сообщениями, задержка Нейгла только мешает
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        error = address + ": " + std::strerror(errno);
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(list);
+    return fd;
+}
+
+} // namespace detail
+
+inline int listenSocket(const std::string& address, std::string& error) {
+    return detail::openSocket(address, true, error);
+}
+
+inline int connectSocket(const std::string& address, std::string& error) {
+    return detail::openSocket(address, false, error);
+}
+
+// Ограничение времени ожидания данных при чтении; 0 - без ограничения
+inline void setReceiveTimeout(int fd, int ms) {
+    timeval tv{};
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+inline bool sendAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        // MSG_NOSIGNAL: разрыв соединения - ошибка отправки, а не SIGPIPE
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+inline bool recvAll(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Заголовок и данные уходят одним вызовом send
+inline bool sendMessage(int fd, std::uint32_t type, const void* data, size_t size) {
+    MessageHeader h = {type, (std::uint32_t)size};
+    const char* header = reinterpret_cast<const char*>(&h);
+    const char* p = static_cast<const char*>(data);
+    std::vector<char> buffer(header, header + sizeof(h));
+    if (size > 0) buffer.insert(buffer.end(), p, p + size);
+    return sendAll(fd, buffer.data(), buffer.size());
+}
+
+// false при разрыве соединения, тайм-ауте или сообщении длиннее maxSize
+inline bool recvMessage(int fd, std::uint32_t& type, std::vector<char>& data, std::uint32_t maxSize) {
+    MessageHeader h;
+    if (!recvAll(fd, &h, sizeof(h)) || h.size > maxSize) return false;
+    type = h.type;
+    data.resize(h.size);
+    return h.size == 0 || recvAll(fd, data.data(), h.size);
+}
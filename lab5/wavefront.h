@@ -0,0 +1,261 @@
+#pragma once
+
+// Волновой (wavefront) трассировщик. Вместо того чтобы вести один луч до
+// конца, каждая стадия выполняется сразу для всей пачки лучей:
+//   1. первичные лучи всех пикселей пересекаются пакетами;
+//   2. попадания затеняются: запросы к источникам ставятся в очередь теневых
+//      лучей, отражённые и преломлённые лучи - в очередь следующего отскока;
+//   3. очередь теневых лучей проверяется целиком, и вклад каждого попадания
+//      собирается из её результатов;
+//   4. очередь следующего отскока пересекается, промахи дают цвет неба,
+//      попадания сжимаются в новую пачку, и всё повторяется со стадии 2.
+// Перед стадией 4 очередь можно упорядочить по coherenceKey (октант
+// направления и ячейка Мортона начала): отражения от соседних точек в одну
+// сторону идут подряд и обходят BVH по тем же узлам.
+// Вклады в пиксель складываются в том же порядке, в каком их снимает со
+// стека shade (обход в глубину, отражённый луч раньше преломлённого), поэтому
+// цвет совпадает с рекурсивным трассировщиком бит в бит.
+// Все очереди живут в арене исполнителя и действительны до её reset().
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+#include "raytracer.h"
+
+template <class Color>
+class Wavefront {
+public:
+    // Трассирует count первичных лучей из начала координат по направлениям
+    // dirs. Цвет i-го луча - colors()[i]. Очереди выделяются из arena.
+    // sortRays упорядочивает вторичные лучи перед пересечением; вклады
+    // сводятся по ключам путей, поэтому на цвет это не влияет.
+    void trace(const Scene& scene, const LightSet& lights, SimdLevel simd, int maxDepth, TraceContext& ctx,
+               const Vec3* dirs, int count, Arena& arena, bool sortRays = false) {
+        hits.bind(arena);
+        rays.bind(arena);
+        sorted.bind(arena);
+        shadows.bind(arena);
+        shadowBegin.bind(arena);
+        contributions.bind(arena);
+        pixelColors.bind(arena);
+        order.bind(arena);
+        intersectPrimary(scene, simd, ctx, dirs, count);
+        while (!hits.empty()) {
+            shadeHits(scene, lights, maxDepth, ctx);
+            testShadows(scene, ctx);
+            gatherHits(scene);
+            if (sortRays) sortByCoherence(scene.bounds());
+            intersectNext(scene, ctx);
+        }
+        resolve(count);
+    }
+
+    const ArenaArray<Color>& colors() const { return pixelColors; }
+
+private:
+    // Луч пачки: пиксель, в который идёт его вклад, вес и ключ порядка вклада
+    struct PathRay {
+        Vec3 orig, dir;
+        float weight;
+        int depth;
+        int pixel;
+        std::uint64_t key;
+    };
+
+    struct PathHit {
+        PathRay ray;
+        Hit hit;
+    };
+
+    struct ShadowQuery {
+        Vec3 orig, dir;
+        float dist;
+        int light;
+        float cosTerm; // освещённость, если луч не заслонён
+        float w;       // интенсивность с затуханием и множителем выборки
+        bool blocked;
+    };
+
+    struct Contribution {
+        int pixel;
+        int order; // номер в очереди вкладов, для однозначного порядка при равных ключах
+        std::uint64_t key;
+        Color color;
+    };
+
+    struct SortEntry {
+        std::uint64_t key;
+        int index;
+    };
+
+    // Ключ вторичного луча: по два бита на уровень, старшие - ближе к первичному
+    // лучу, 1 - отражённый, 2 - преломлённый. Сортировка по ключу даёт порядок
+    // обхода стека в глубину. В 64 бита входят kMaxDepth уровней, глубже
+    // рендерер не трассирует; если всё же глубже, ключ не меняется, и равные
+    // ключи упорядочиваются по номеру вклада - однозначно, но уже не в порядке
+    // рекурсивного трассировщика.
+    static_assert(2 * kMaxDepth <= 64, "уровни kMaxDepth должны помещаться в ключ");
+    static std::uint64_t childKey(std::uint64_t parent, int depth, bool refraction) {
+        int level = depth - 1;
+        if (level >= kMaxDepth) return parent;
+        return parent | ((std::uint64_t)(refraction ? 2 : 1) << (62 - 2 * level));
+    }
+
+    void intersectPrimary(const Scene& scene, SimdLevel simd, TraceContext& ctx, const Vec3* dirs, int count) {
+        auto add = [&](int i, const Hit& hit) {
+            if (hit.prim == -1) {
+                contributions.push_back({i, (int)contributions.size(), 0, Radiance<Color>::sky()});
+                return;
+            }
+            hits.push_back({PathRay{Vec3(0, 0, 0), dirs[i], 1.0f, 0, i, 0}, hit});
+        };
+
+        int lanes = packetWidth(simd);
+        RayPacket packet;
+        packet.orig = Vec3(0, 0, 0);
+        int i = 0;
+        for (; lanes > 1 && i + lanes <= count; i += lanes) {
+            for (int k = 0; k < lanes; k++) {
+                packet.dx[k] = dirs[i + k].x;
+                packet.dy[k] = dirs[i + k].y;
+                packet.dz[k] = dirs[i + k].z;
+            }
+            intersectPacket(scene, simd, packet);
+            ctx.rays += lanes;
+            LAB5_STAT(ctx.stats.primary += lanes);
+            for (int k = 0; k < lanes; k++) {
+                Hit hit;
+                hit.t = packet.t[k];
+                hit.prim = packet.hit[k];
+                hit.instance = packet.instance[k];
+                add(i + k, hit);
+            }
+        }
+        for (; i < count; i++) {
+            ctx.rays++;
+            LAB5_STAT(ctx.stats.primary++);
+            Hit hit;
+            scene.intersect(Vec3(0, 0, 0), dirs[i], hit);
+            add(i, hit);
+        }
+    }
+
+    // Стадия 2: запросы к источникам и вторичные лучи всех попаданий
+    void shadeHits(const Scene& scene, const LightSet& lights, int maxDepth, TraceContext& ctx) {
+        shadows.clear();
+        shadowBegin.clear();
+        rays.clear();
+        for (const PathHit& h : hits) {
+            const PathRay& r = h.ray;
+            Vec3 phit = r.orig + r.dir * h.hit.t;
+            Vec3 nhit = scene.normal(h.hit, phit);
+            LAB5_STAT(threadRayStats().maxDepth = std::max(threadRayStats().maxDepth, r.depth));
+            const Material& material = scene.material(h.hit);
+
+            shadowBegin.push_back((int)shadows.size());
+            forEachLight<Color>(lights, phit, r.dir, [&](int i, float scale) {
+                const Light& light = lights[i];
+                Vec3 toLight = light.pos - phit;
+                Vec3 lightDir = toLight.normalize();
+                ctx.rays++;
+                LAB5_STAT(threadRayStats().shadow++);
+                ShadowQuery q;
+                q.orig = phit + nhit * 1e-4f;
+                q.dir = lightDir;
+                q.dist = toLight.length();
+                q.light = i;
+                q.cosTerm = std::max(0.0f, nhit.dot(lightDir));
+                q.w = light.intensity * light.attenuation(toLight.dot(toLight)) * scale;
+                q.blocked = false;
+                shadows.push_back(q);
+            });
+
+            if (material.reflection > 0.0f || material.refraction > 0.0f) {
+                secondaryRays(r.dir, phit, nhit, material, r.weight, r.depth, maxDepth,
+                              [&](const RayTask& task, bool refraction) {
+                    RayTask t = task;
+                    if (!keepRay(t, ctx)) return;
+                    LAB5_STAT(refraction ? threadRayStats().refraction++ : threadRayStats().reflection++);
+                    rays.push_back({t.orig, t.dir, t.weight, t.depth, r.pixel, childKey(r.key, t.depth, refraction)});
+                });
+            }
+        }
+        shadowBegin.push_back((int)shadows.size());
+    }
+
+    // Стадия 3: вся очередь теневых лучей
+    void testShadows(const Scene& scene, TraceContext& ctx) {
+        for (ShadowQuery& q : shadows) {
+            q.blocked = scene.occluded(q.orig, q.dir, q.dist, ctx.occluderCache(q.light));
+        }
+    }
+
+    // Вклад каждого попадания - те же операции в том же порядке, что в shadeSurface
+    void gatherHits(const Scene& scene) {
+        for (size_t h = 0; h < hits.size(); h++) {
+            const Material& material = scene.material(hits[h].hit);
+            Color surface;
+            for (int j = shadowBegin[h]; j < shadowBegin[h + 1]; j++) {
+                const ShadowQuery& q = shadows[j];
+                float shade = q.blocked ? 0.2f : q.cosTerm;
+                surface = surface + Radiance<Color>::light(q.light, material.color * (shade * q.w));
+            }
+            if (material.reflection > 0.0f || material.refraction > 0.0f) {
+                surface = surface * (1.0f - (material.reflection + material.refraction));
+            }
+            contributions.push_back({hits[h].ray.pixel, (int)contributions.size(), hits[h].ray.key, surface * hits[h].ray.weight});
+        }
+    }
+
+    void sortByCoherence(const AABB& bounds) {
+        order.clear();
+        for (size_t i = 0; i < rays.size(); i++) {
+            order.push_back({coherenceKey(rays[i].orig, rays[i].dir, bounds), (int)i});
+        }
+        std::sort(order.begin(), order.end(), [](const SortEntry& a, const SortEntry& b) {
+            return a.key != b.key ? a.key < b.key : a.index < b.index;
+        });
+        sorted.clear();
+        for (const SortEntry& e : order) sorted.push_back(rays[e.index]);
+        rays.swap(sorted);
+    }
+
+    // Стадия 4: пересечение следующего отскока и сжатие попаданий
+    void intersectNext(const Scene& scene, TraceContext& ctx) {
+        hits.clear();
+        for (const PathRay& r : rays) {
+            ctx.rays++;
+            Hit hit;
+            if (!scene.intersect(r.orig, r.dir, hit)) {
+                contributions.push_back({r.pixel, (int)contributions.size(), r.key, Radiance<Color>::sky() * r.weight});
+                continue;
+            }
+            hits.push_back({r, hit});
+        }
+    }
+
+    // std::sort, а не stable_sort: тот выделял бы временный буфер вне арены
+    void resolve(size_t count) {
+        std::sort(contributions.begin(), contributions.end(), [](const Contribution& a, const Contribution& b) {
+            if (a.pixel != b.pixel) return a.pixel < b.pixel;
+            return a.key != b.key ? a.key < b.key : a.order < b.order;
+        });
+        pixelColors.assign(count, Color());
+        for (size_t i = 0; i < contributions.size(); i++) {
+            const Contribution& c = contributions[i];
+            bool first = i == 0 || contributions[i - 1].pixel != c.pixel;
+            pixelColors[c.pixel] = first ? c.color : pixelColors[c.pixel] + c.color;
+        }
+    }
+
+    ArenaArray<PathHit> hits;       // сжатые попадания текущего отскока
+    ArenaArray<PathRay> rays;       // очередь следующего отскока
+    ArenaArray<PathRay> sorted;     // очередь после упорядочивания
+    ArenaArray<ShadowQuery> shadows;
+    ArenaArray<int> shadowBegin;    // первый теневой запрос каждого попадания
+    ArenaArray<Contribution> contributions;
+    ArenaArray<Color> pixelColors;
+    ArenaArray<SortEntry> order;    // ключи связности очереди отскока
+};